@@ -1,596 +1,5641 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-#include <stdbool.h>
-#include <string.h>
-
-typedef enum { EMPTY, MONSTER, ITEM, TREASURE } ContentType;
-typedef enum { GOBLIN, SKELETON, MAX_MONSTER_TYPES } MonsterType;
-typedef enum { 
-    HEALTH_POTION_SMALL, HEALTH_POTION_MEDIUM, HEALTH_POTION_LARGE, 
-    POWER_GLOVE, MAGIC_AMULET, MAX_ITEM_TYPES 
-} ItemType;
-
-// Function pointers for monster actions
-typedef void (*MonsterAction)(void);
-
-typedef struct {
-    MonsterType type;
-    int hp, damage;
-    const char* name;
-    MonsterAction action; // Function pointer for special action
-} Monster;
-
-typedef struct {
-    ItemType type;
-    int value;
-    const char* name;
-} Item;
-
-typedef struct {
-    ContentType type;
-    union {
-        Monster* monster;
-        Item* item;
-    } content;
-} RoomContent;
-
-// Linked list node for rooms
-typedef struct RoomNode {
-    struct Room* room;
-    struct RoomNode* next;
-} RoomNode;
-
-typedef struct Room {
-    int id, num_doors, max_doors;
-    struct Room** doors;
-    RoomContent content;
-    bool visited, cleared;
-} Room;
-
-typedef struct {
-    int current_room_id; // Toegevoegd: houdt bij in welke kamer de speler is
-    int hp, max_hp, damage;
-    bool has_treasure;
-} Player;
-
-typedef struct {
-    Room *entrance;
-    RoomNode *rooms_list; // Linked list of rooms
-    int num_rooms;
-    Player player;
-} Dungeon;
-
-// Helper macros
-#define RAND_RANGE(min, max) ((min) + rand() % ((max) - (min) + 1))
-#define CLEAR_INPUT() while (getchar() != '\n')
-
-// Function prototypes
-Room* create_room(int id, int max_doors);
-Monster* create_monster(MonsterType type);
-Item* create_item();
-void connect_rooms(Room* a, Room* b);
-bool rooms_connected(Room* a, Room* b);
-Dungeon* generate_dungeon(int num_rooms);
-void populate_rooms(Dungeon* d);
-void free_dungeon(Dungeon* d);
-bool save_game(Dungeon* d, const char* filename);
-Dungeon* load_game(const char* filename);
-void game_loop(Dungeon* d);
-Room* find_room_by_id(Dungeon* d, int id);
-void add_room_to_list(Dungeon* d, Room* room);
-
-// Monster actions
-void goblin_special(void) {
-    printf("De goblin gooit een steen naar je! (+5 extra schade deze ronde)\n");
-}
-
-void skeleton_special(void) {
-    printf("Het skelet herrijst tijdelijk met 10 HP!\n");
-}
-
-// Game functions
-void print_room(Room* r) {
-    const char* contents[] = {"De kamer is leeg", "Het lijk van een %s ligt op de grond", 
-                             "De lege schatkist staat hier", "De schat ligt hier!"};
-    const char* items[] = {"Kleine Health Potion", "Medium Health Potion", "Grote Health Potion", 
-                          "Power Glove", "Magisch Amulet"};
-    
-    if (!r->cleared) {
-        if (r->content.type == MONSTER)
-            printf("Er is een %s in de kamer\n", r->content.content.monster->name);
-        else if (r->content.type == ITEM)
-            printf("Er ligt een %s op de grond\n", r->content.content.item->name);
-        else if (r->content.type == TREASURE)
-            printf("%s\n", contents[3]);
-    } else {
-        printf("%s\n", contents[r->content.type]);
-    }
-}
-
-void print_doors(Room* r) {
-    printf("De kamer heeft deuren naar: ");
-    for (int i = 0; i < r->num_doors; i++) 
-        printf("%d%s", r->doors[i]->id, (i < r->num_doors-1) ? ", " : "\n");
-}
-
-bool fight(Dungeon* d, Monster* m) {
-    printf("\n=== Gevecht met %s ===\nHP: %d/%d, Damage: %d\n", 
-           m->name, d->player.hp, d->player.max_hp, d->player.damage);
-    printf("%s HP: %d, Damage: %d\n\n", m->name, m->hp, m->damage);
-
-    // 25% chance for special action
-    if (rand() % 4 == 0 && m->action) {
-        m->action();
-        if (m->type == GOBLIN) {
-            // Extra schade voor goblin special attack
-            d->player.hp -= 5;
-            printf("Je verliest 5 extra hp (%d/%d)\n", 
-                   d->player.hp > 0 ? d->player.hp : 0, d->player.max_hp);
-        } else if (m->type == SKELETON) {
-            // Extra HP voor skeleton special
-            m->hp += 10;
-            printf("Skelet heeft nu %d HP\n", m->hp);
-        }
-    }
-
-    while (d->player.hp > 0 && m->hp > 0) {
-        int pattern = rand() % 16;
-        printf("Aanval volgorde: ");
-        for (int i = 3; i >= 0; i--) printf("%d", (pattern >> i) & 1);
-        printf(" (0 = monster valt aan, 1 = speler valt aan)\n");
-
-        for (int i = 3; i >= 0 && d->player.hp > 0 && m->hp > 0; i--) {
-            if ((pattern >> i) & 1) {
-                m->hp -= d->player.damage;
-                printf("Jij valt de %s aan voor %d schade!\n", m->name, d->player.damage);
-                printf("%s verliest %d hp (%d/%d)\n", m->name, d->player.damage, 
-                       m->hp > 0 ? m->hp : 0, m->hp + d->player.damage);
-                if (m->hp <= 0) return true;
-            } else {
-                d->player.hp -= m->damage;
-                printf("%s valt jou aan voor %d schade!\n", m->name, m->damage);
-                printf("Jij verliest %d hp (%d/%d)\n", m->damage, 
-                       d->player.hp > 0 ? d->player.hp : 0, d->player.max_hp);
-                if (d->player.hp <= 0) return false;
-            }
-        }
-
-        if (d->player.hp > 0 && m->hp > 0) {
-            printf("\n=== Status na ronde ===\nHP: %d/%d\n%s HP: %d\n\n", 
-                   d->player.hp, d->player.max_hp, m->name, m->hp);
-            printf("Druk op enter om door te gaan...");
-            CLEAR_INPUT(); getchar();
-        }
-    }
-    return true;
-}
-
-int get_input(const char* prompt, int min, int max) {
-    int input;
-    while (1) {
-        printf("%s", prompt);
-        if (scanf("%d", &input) != 1) {
-            CLEAR_INPUT();
-            printf("Voer een nummer tussen %d en %d in.\n", min, max);
-            continue;
-        }
-        CLEAR_INPUT();
-        if (input >= min && input <= max) return input;
-        printf("Ongeldige keuze. Kies tussen %d en %d.\n", min, max);
-    }
-}
-
-// Main game functions
-int main(int argc, char* argv[]) {
-    srand(time(NULL));
-    
-    Dungeon* dungeon = NULL;
-    
-    if (argc > 1) {
-        if (strcmp(argv[1], "-l") == 0 && argc > 2) {
-            // Load game mode
-            dungeon = load_game(argv[2]);
-            if (!dungeon) {
-                printf("Kon spel niet laden van %s\n", argv[2]);
-                return 1;
-            }
-            printf("\nSpel geladen, start in kamer %d\n", dungeon->player.current_room_id);
-        } else if (strcmp(argv[1], "-n") == 0 && argc > 2) {
-            // New game mode
-            int rooms = atoi(argv[2]);
-            if (rooms < 3 || rooms > 20) {
-                printf("Aantal kamers moet tussen 3 en 20 zijn\n");
-                return 1;
-            }
-            dungeon = generate_dungeon(rooms);
-            populate_rooms(dungeon);
-            printf("\nNieuw spel gestart met %d kamers\nStart in kamer 0\n", rooms);
-        } else {
-            printf("Usage:\n%s -n <aantal kamers>  - Nieuw spel\n%s -l <bestandsnaam> - Laad spel\n", 
-                   argv[0], argv[0]);
-            return 1;
-        }
-    } else {
-        // Interactive mode if no arguments
-        printf("=== Dungeon Adventure ===\n1. Nieuw spel\n2. Laad spel\n");
-        int choice = get_input("Keuze: ", 1, 2);
-        
-        if (choice == 1) {
-            int rooms = get_input("Aantal kamers (3-20): ", 3, 20);
-            dungeon = generate_dungeon(rooms);
-            populate_rooms(dungeon);
-            printf("\nStart in kamer 0\n");
-        } else {
-            dungeon = load_game("dungeon_save.dat");
-            if (!dungeon) {
-                printf("Nieuw spel starten...\n");
-                int rooms = get_input("Aantal kamers (3-20): ", 3, 20);
-                dungeon = generate_dungeon(rooms);
-                populate_rooms(dungeon);
-                printf("\nStart in kamer 0\n");
-            }
-        }
-    }
-
-    // Show starting room
-    Room* current = find_room_by_id(dungeon, dungeon->player.current_room_id);
-    print_room(current);
-    print_doors(current);
-    
-    game_loop(dungeon);
-    free_dungeon(dungeon);
-    return 0;
-}
-
-void game_loop(Dungeon* d) {
-    while (d->player.hp > 0 && !d->player.has_treasure) {
-        Room* current = find_room_by_id(d, d->player.current_room_id);
-        printf("\n1. Verplaatsen\n2. Ruim kamer op\n3. Status\n4. Schat\n5. Opslaan\n6. Stoppen\n");
-        switch(get_input("Keuze: ", 1, 6)) {
-            case 1: {
-                print_doors(current);
-                int target = get_input("Kies deur: ", 0, d->num_rooms-1);
-                
-                for (int i = 0; i < current->num_doors; i++) {
-                    if (current->doors[i]->id == target) {
-                        d->player.current_room_id = target;
-                        printf("Naar kamer %d\n", target);
-                        Room* new_room = find_room_by_id(d, target);
-                        print_room(new_room);
-                        if (new_room->content.type == MONSTER && !new_room->cleared && 
-                            !fight(d, new_room->content.content.monster)) {
-                            printf("Game Over!\n");
-                            return;
-                        }
-                        break;
-                    }
-                }
-                break;
-            }
-            case 2: {
-                if (current->content.type == MONSTER && !current->cleared) {
-                    if (!fight(d, current->content.content.monster)) {
-                        printf("Game Over!\n");
-                        return;
-                    }
-                    current->cleared = true;
-                } else if (current->content.type == ITEM && !current->cleared) {
-                    Item* it = current->content.content.item;
-                    switch(it->type) {
-                        case HEALTH_POTION_SMALL: case HEALTH_POTION_MEDIUM: case HEALTH_POTION_LARGE:
-                            d->player.hp = (d->player.hp += it->value) > d->player.max_hp ? d->player.max_hp : d->player.hp;
-                            break;
-                        case POWER_GLOVE: d->player.damage += it->value; break;
-                        case MAGIC_AMULET: 
-                            d->player.max_hp += it->value;
-                            d->player.hp += it->value;
-                            break;
-                    }
-                    printf("Je gebruikt %s\n", it->name);
-                    free(it);
-                    current->content.type = EMPTY;
-                    current->cleared = true;
-                } else {
-                    printf("Niets om op te ruimen\n");
-                }
-                break;
-            }
-            case 3: {
-                printf("\n=== Status ===\nHP: %d/%d\nDamage: %d\nKamer: %d\n%s\n", 
-                       d->player.hp, d->player.max_hp, d->player.damage, 
-                       d->player.current_room_id, d->player.has_treasure ? "Heeft schat" : "");
-                break;
-            }
-            case 4: {
-                if (current->content.type == TREASURE && !current->cleared) {
-                    printf("Je wint!\n");
-                    d->player.has_treasure = current->cleared = true;
-                } else {
-                    printf("Geen schat hier\n");
-                }
-                break;
-            }
-            case 5: {
-                if (save_game(d, "dungeon_save.dat")) 
-                    printf("Opgeslagen!\n");
-                else 
-                    printf("Opslaan mislukt\n");
-                break;
-            }
-            case 6: return;
-        }
-    }
-    printf(d->player.has_treasure ? "\n*** Gewonnen! ***\n" : "\n*** Game Over ***\n");
-}
-
-// Dungeon generation and management
-Room* create_room(int id, int max_doors) {
-    Room* r = malloc(sizeof(Room));
-    *r = (Room){id, 0, max_doors, malloc(max_doors * sizeof(Room*)), 
-                {EMPTY}, false, false};
-    return r;
-}
-
-Monster* create_monster(MonsterType type) {
-    const char* names[] = {"Goblin", "Skeleton"};
-    int hp[] = {RAND_RANGE(30, 50), RAND_RANGE(20, 35)};
-    int dmg[] = {RAND_RANGE(5, 10), RAND_RANGE(8, 15)};
-    MonsterAction actions[] = {goblin_special, skeleton_special};
-    
-    Monster* m = malloc(sizeof(Monster));
-    *m = (Monster){type, hp[type], dmg[type], names[type], actions[type]};
-    return m;
-}
-
-Item* create_item() {
-    Item* it = malloc(sizeof(Item));
-    it->type = rand() % MAX_ITEM_TYPES;
-    const char* names[] = {"Kleine Health Potion", "Medium Health Potion", 
-                          "Grote Health Potion", "Power Glove", "Magisch Amulet"};
-    int values[] = {RAND_RANGE(5, 10), RAND_RANGE(10, 20), RAND_RANGE(20, 35), 
-                   RAND_RANGE(3, 6), RAND_RANGE(1, 10)};
-    *it = (Item){it->type, values[it->type], names[it->type]};
-    return it;
-}
-
-void connect_rooms(Room* a, Room* b) {
-    if (a->num_doors < a->max_doors && b->num_doors < b->max_doors) {
-        a->doors[a->num_doors++] = b;
-        b->doors[b->num_doors++] = a;
-    }
-}
-
-bool rooms_connected(Room* a, Room* b) {
-    for (int i = 0; i < a->num_doors; i++)
-        if (a->doors[i] == b) return true;
-    return false;
-}
-
-void add_room_to_list(Dungeon* d, Room* room) {
-    RoomNode* new_node = malloc(sizeof(RoomNode));
-    new_node->room = room;
-    new_node->next = NULL;
-    
-    if (!d->rooms_list) {
-        d->rooms_list = new_node;
-    } else {
-        RoomNode* current = d->rooms_list;
-        while (current->next) current = current->next;
-        current->next = new_node;
-    }
-}
-
-Room* find_room_by_id(Dungeon* d, int id) {
-    RoomNode* current = d->rooms_list;
-    while (current) {
-        if (current->room->id == id) return current->room;
-        current = current->next;
-    }
-    return NULL;
-}
-
-Dungeon* generate_dungeon(int num_rooms) {
-    Dungeon* d = malloc(sizeof(Dungeon));
-    d->num_rooms = num_rooms;
-    d->rooms_list = NULL;
-    
-    // Create all rooms and add to linked list
-    for (int i = 0; i < num_rooms; i++) {
-        Room* r = create_room(i, RAND_RANGE(1, 4));
-        add_room_to_list(d, r);
-    }
-    
-    d->entrance = find_room_by_id(d, 0);
-    d->player = (Player){0, 100, 100, RAND_RANGE(10, 20), false}; // current_room_id initialized to 0
-    
-    // Connect rooms in a tree structure
-    for (int i = 1; i < num_rooms; i++) {
-        Room* new_room = find_room_by_id(d, i);
-        Room* existing_room = find_room_by_id(d, rand() % i);
-        connect_rooms(existing_room, new_room);
-    }
-    
-    // Add extra random connections
-    RoomNode* current = d->rooms_list;
-    while (current) {
-        Room* r = current->room;
-        for (int j = r->num_doors; j < r->max_doors; j++) {
-            int target, attempts = 0;
-            do { 
-                target = rand() % num_rooms; 
-            } while ((target == r->id || rooms_connected(r, find_room_by_id(d, target))) && ++attempts < 100);
-            
-            if (attempts < 100) {
-                connect_rooms(r, find_room_by_id(d, target));
-            }
-        }
-        current = current->next;
-    }
-    return d;
-}
-
-void populate_rooms(Dungeon* d) {
-    RoomNode* current = d->rooms_list;
-    while (current) {
-        current->room->content.type = EMPTY;
-        current->room->cleared = false;
-        current = current->next;
-    }
-
-    int treasure = 1 + rand() % (d->num_rooms - 1);
-    find_room_by_id(d, treasure)->content.type = TREASURE;
-    
-    int monster;
-    do { monster = 1 + rand() % (d->num_rooms - 1); } while (monster == treasure);
-    Room* monster_room = find_room_by_id(d, monster);
-    monster_room->content.type = MONSTER;
-    monster_room->content.content.monster = create_monster(rand() % MAX_MONSTER_TYPES);
-
-    current = d->rooms_list;
-    while (current) {
-        if (current->room->id == 0 || current->room->id == treasure || current->room->id == monster) {
-            current = current->next;
-            continue;
-        }
-        
-        int r = rand() % 100;
-        if (r < 40) {
-            current->room->content.type = MONSTER;
-            current->room->content.content.monster = create_monster(rand() % MAX_MONSTER_TYPES);
-        } else if (r < 75) {
-            current->room->content.type = ITEM;
-            current->room->content.content.item = create_item();
-        }
-        current = current->next;
-    }
-}
-
-bool save_game(Dungeon* d, const char* filename) {
-    FILE* f = fopen(filename, "wb");
-    if (!f) return false;
-
-    fwrite(&d->num_rooms, sizeof(int), 1, f);
-    fwrite(&d->player, sizeof(Player), 1, f);
-
-    RoomNode* current = d->rooms_list;
-    while (current) {
-        Room* r = current->room;
-        fwrite(&r->id, sizeof(int), 1, f);
-        fwrite(&r->num_doors, sizeof(int), 1, f);
-        fwrite(&r->max_doors, sizeof(int), 1, f);
-        fwrite(&r->visited, sizeof(bool), 1, f);
-        fwrite(&r->cleared, sizeof(bool), 1, f);
-        fwrite(&r->content.type, sizeof(ContentType), 1, f);
-
-        if (r->content.type == MONSTER) {
-            Monster* m = r->content.content.monster;
-            fwrite(&m->type, sizeof(MonsterType), 1, f);
-            fwrite(&m->hp, sizeof(int), 1, f);
-            fwrite(&m->damage, sizeof(int), 1, f);
-        } else if (r->content.type == ITEM) {
-            Item* it = r->content.content.item;
-            fwrite(&it->type, sizeof(ItemType), 1, f);
-            fwrite(&it->value, sizeof(int), 1, f);
-        }
-        current = current->next;
-    }
-
-    current = d->rooms_list;
-    while (current) {
-        Room* r = current->room;
-        for (int j = 0; j < r->num_doors; j++) {
-            fwrite(&r->doors[j]->id, sizeof(int), 1, f);
-        }
-        current = current->next;
-    }
-
-    fclose(f);
-    return true;
-}
-
-Dungeon* load_game(const char* filename) {
-    FILE* f = fopen(filename, "rb");
-    if (!f) return NULL;
-
-    int num_rooms;
-    fread(&num_rooms, sizeof(int), 1, f);
-
-    Dungeon* d = malloc(sizeof(Dungeon));
-    d->num_rooms = num_rooms;
-    d->rooms_list = NULL;
-    fread(&d->player, sizeof(Player), 1, f);
-
-    // First pass: create all rooms
-    for (int i = 0; i < num_rooms; i++) {
-        int id, num_doors, max_doors;
-        bool visited, cleared;
-        ContentType type;
-        
-        fread(&id, sizeof(int), 1, f);
-        fread(&num_doors, sizeof(int), 1, f);
-        fread(&max_doors, sizeof(int), 1, f);
-        fread(&visited, sizeof(bool), 1, f);
-        fread(&cleared, sizeof(bool), 1, f);
-        fread(&type, sizeof(ContentType), 1, f);
-
-        Room* r = create_room(id, max_doors);
-        r->num_doors = num_doors;
-        r->visited = visited;
-        r->cleared = cleared;
-        r->content.type = type;
-
-        if (type == MONSTER) {
-            Monster* m = malloc(sizeof(Monster));
-            fread(&m->type, sizeof(MonsterType), 1, f);
-            fread(&m->hp, sizeof(int), 1, f);
-            fread(&m->damage, sizeof(int), 1, f);
-            m->name = m->type == GOBLIN ? "Goblin" : "Skeleton";
-            m->action = m->type == GOBLIN ? goblin_special : skeleton_special;
-            r->content.content.monster = m;
-        } else if (type == ITEM) {
-            Item* it = malloc(sizeof(Item));
-            fread(&it->type, sizeof(ItemType), 1, f);
-            fread(&it->value, sizeof(int), 1, f);
-            const char* names[] = {"Kleine Health Potion", "Medium Health Potion", 
-                                  "Grote Health Potion", "Power Glove", "Magisch Amulet"};
-            it->name = names[it->type];
-            r->content.content.item = it;
-        }
-
-        add_room_to_list(d, r);
-    }
-
-    d->entrance = find_room_by_id(d, 0);
-
-    // Second pass: connect doors
-    RoomNode* current = d->rooms_list;
-    while (current) {
-        Room* r = current->room;
-        for (int j = 0; j < r->num_doors; j++) {
-            int id;
-            fread(&id, sizeof(int), 1, f);
-            r->doors[j] = find_room_by_id(d, id);
-        }
-        current = current->next;
-    }
-
-    fclose(f);
-    return d;
-}
-
-void free_dungeon(Dungeon* d) {
-    RoomNode* current = d->rooms_list;
-    while (current) {
-        RoomNode* next = current->next;
-        if (current->room->content.type == MONSTER) 
-            free(current->room->content.content.monster);
-        else if (current->room->content.type == ITEM) 
-            free(current->room->content.content.item);
-        free(current->room->doors);
-        free(current->room);
-        free(current);
-        current = next;
-    }
-    free(d);
-}
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <signal.h>
+#define HAVE_MMAP 1
+#define HAVE_PTHREAD 1
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAVE_EPOLL 1
+#endif
+#include <stdatomic.h>
+
+typedef enum { EMPTY, MONSTER, ITEM, TREASURE } ContentType;
+
+// Monster and item types. These lists are the only place a type is defined:
+// the enums and the monster_info/item_info tables are expanded from them, and
+// fight, game_loop and the loaders only go through the tables.
+//   X(id, name, hp min, hp max, damage min, damage max,
+//     special text (NULL = none), special damage to the player, special hp for the monster, hp text)
+#define MONSTER_TYPES(X) \
+    X(GOBLIN, "Goblin", 30, 50, 5, 10, \
+      "De goblin gooit een steen naar je! (+5 extra schade deze ronde)", 5, 0, NULL) \
+    X(SKELETON, "Skeleton", 20, 35, 8, 15, \
+      "Het skelet herrijst tijdelijk met 10 HP!", 0, 10, "Skelet heeft nu %d HP")
+//   X(id, name, value min, value max, effect)
+#define ITEM_TYPES(X) \
+    X(HEALTH_POTION_SMALL, "Kleine Health Potion", 5, 10, EFFECT_HEAL) \
+    X(HEALTH_POTION_MEDIUM, "Medium Health Potion", 10, 20, EFFECT_HEAL) \
+    X(HEALTH_POTION_LARGE, "Grote Health Potion", 20, 35, EFFECT_HEAL) \
+    X(POWER_GLOVE, "Power Glove", 3, 6, EFFECT_DAMAGE) \
+    X(MAGIC_AMULET, "Magisch Amulet", 1, 10, EFFECT_MAX_HP)
+
+#define TYPE_ID(id, ...) id,
+typedef enum { MONSTER_TYPES(TYPE_ID) MAX_MONSTER_TYPES } MonsterType;
+typedef enum { ITEM_TYPES(TYPE_ID) MAX_ITEM_TYPES } ItemType;
+
+// What using an item does with its value
+typedef enum { 
+    EFFECT_HEAL,   // hp, up to max hp
+    EFFECT_DAMAGE, // damage
+    EFFECT_MAX_HP  // max hp and hp
+} ItemEffect;
+
+typedef struct {
+    const char* name;
+    int min_hp, max_hp, min_damage, max_damage;
+    const char* special;              // Announces the special action, NULL = none
+    int special_damage, special_heal; // Applied when the special action happens
+    const char* heal_text;            // Format for the monster's hp after special_heal
+} MonsterInfo;
+
+typedef struct {
+    const char* name;
+    int min_value, max_value;
+    ItemEffect effect;
+} ItemInfo;
+
+typedef struct Sink Sink;
+
+// Name, stats and special action come from monster_info by type
+typedef struct {
+    MonsterType type;
+    int hp, damage;
+} Monster;
+
+// Name and effect come from item_info by type
+typedef struct {
+    ItemType type;
+    int value;
+} Item;
+
+// Content is stored inline in the room
+typedef struct {
+    ContentType type;
+    union {
+        Monster monster;
+        Item item;
+    } content;
+} RoomContent;
+
+// Content and cleared flag of a room packed into one word (see Room state)
+typedef uint64_t RoomState;
+
+// 24 bytes on 64-bit targets
+typedef struct Room {
+    int id;
+    uint8_t num_doors, max_doors;
+    bool visited;
+    uint32_t* doors; // Row of max_doors slots in the dungeon's door table
+    _Atomic RoomState state; // Read and changed through room_state, room_set and room_cas
+} Room;
+
+typedef struct {
+    int current_room_id; // Toegevoegd: houdt bij in welke kamer de speler is
+    int hp, max_hp, damage;
+    bool has_treasure;
+} Player;
+
+// xoshiro256** state; every dungeon carries its own generator
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+// Bump allocator that owns every object of one dungeon
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used, size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+    size_t block_size;
+} Arena;
+
+// Read-only mapping of a save file; rooms are copied out on first use
+typedef struct {
+    void* base;
+    size_t size;
+    const unsigned char* records; // Room records in the mapping
+    uint32_t* doors;              // Door id block in the mapping, never written
+    Room** overlay;               // Open-addressed id -> Room of rooms copied out
+    uint32_t overlay_cap, overlay_count;
+} SaveMapping;
+
+// Cached analytics over the door graph, built on first use (see dungeon_graph)
+typedef struct {
+    int32_t* dist;         // Doors from the entrance, -1 when unreachable
+    int32_t* parent;       // Previous room on a shortest path from the entrance
+    int32_t* uf;           // Union-find over rooms, one set per component
+    int32_t* uf_size;
+    uint8_t* articulation; // 1 when removing the room splits its component
+    int32_t* queue;        // BFS scratch, num_rooms entries
+    int components;
+    int treasure;          // Last known treasure room, -1 = none found
+    bool articulation_valid;
+} RoomGraph;
+
+// Built room of a lazy dungeon, with room for all its doors
+typedef struct {
+    Room room;
+    uint32_t doors[10]; // LAZY_MAX_DOORS
+    int32_t prev, next; // Recently used list, most recent first
+} LazySlot;
+
+// Flags and content (bytes 6 to 19 of a room record) of a changed room
+typedef struct {
+    uint32_t key; // Room id + 1, 0 = free
+    unsigned char state[14];
+} LazyState;
+
+// Rooms built on demand from (seed, id), see generate_lazy_dungeon
+typedef struct {
+    uint64_t seed;
+    int treasure;
+    LazySlot* slots;
+    int capacity, used, head, tail;
+    int32_t* index;     // Open-addressed id -> slot, -1 = free
+    uint32_t index_mask;
+    LazyState* saved;   // Open-addressed, changed rooms that may not be built
+    uint32_t saved_cap, saved_count;
+} LazyDungeon;
+
+// Append-only log of the changes since the last full save (see journal_save)
+typedef struct {
+    FILE* f;
+    char* snapshot;     // Save file the journal belongs to
+    long size, snapshot_size;
+    uint32_t* dirty;    // Open-addressed set of id + 1 of the rooms changed since the last append
+    int32_t* dirty_ids; // Those rooms in the order they changed
+    int num_dirty, dirty_cap;
+    unsigned char player[17]; // Player record as of the last append
+} Journal;
+
+typedef struct {
+    Room *entrance;
+    Room *rooms; // Room table, indexed by id (NULL for a mapped save)
+    uint32_t *doors; // Door table: the rows of all rooms back to back, in id order
+    int num_rooms;
+    Player player;
+    Rng rng; // Drives generation, population, combat and scripted policies
+    Arena arena; // Rooms, door arrays, monsters and items
+    SaveMapping* map; // Set when loaded with load_game_mapped
+    LazyDungeon* lazy; // Set by generate_lazy_dungeon, rooms come from lazy_room
+    RoomGraph* graph; // Analytics caches, kept up to date by connect_rooms
+    Journal* journal; // Open after the first journal_save
+    const char* autosave; // game_loop journals every action to this save
+    bool compact; // save_game writes the compressed format (see save_compact)
+    Sink* out; // Game text and events, NULL = none
+    bool headless; // No prompts (simulation)
+    int turns; // Menu actions taken by game_loop
+    uint32_t* taken; // Per room: contents this player used up, for the -c check; NULL = not counted
+    long lost_races; // Room changes another player got in first, so they were decided again
+} Dungeon;
+
+// Where the game text goes: prose, or one record per event for log processing
+typedef enum { OUT_TEXT, OUT_CSV, OUT_BINARY } OutMode;
+#define OUT_BUFFER 8192
+
+struct Sink {
+    OutMode mode;
+    FILE* f;
+    void (*drain)(Sink* s, const char* data, size_t len); // Takes the output instead of f when set
+    void* ctx;
+    size_t used;
+    char buf[OUT_BUFFER]; // Written out when full and at every prompt (sink_flush)
+};
+
+// Everything game_loop and fight report; the arguments of each are listed in event_names
+typedef enum {
+    EV_START, EV_ROOM, EV_DOORS, EV_DOOR, EV_FIGHT, EV_MONSTER, EV_SPECIAL, EV_SPECIAL_HIT, 
+    EV_SPECIAL_HEAL, EV_PATTERN, EV_PLAYER_HIT, EV_MONSTER_HIT, EV_ROUND, EV_MENU, EV_MOVE, 
+    EV_DIED, EV_ITEM, EV_NOTHING, EV_STATUS, EV_TREASURE, EV_NO_TREASURE, EV_SAVED, 
+    EV_AUTOSAVE_FAILED, EV_END, EV_DANGER, NUM_EVENTS
+} EventCode;
+
+#define EVENT_ARGS 5
+
+// How a game_step left the game
+typedef enum { STEP_CONTINUE, STEP_DIED, STEP_QUIT } StepResult;
+
+// Decides the menu choices and doors in game_loop
+typedef struct Policy {
+    int (*choose_action)(struct Policy* p, Dungeon* d, Room* current); // 1-6, as in the menu
+    int (*choose_door)(struct Policy* p, Dungeon* d, Room* current);   // Target room id
+    int max_turns; // game_loop stops after this many actions, 0 = no limit
+} Policy;
+
+// Recorded session, being written or replayed (see the record and replay section)
+enum { TRACE_GENERATED, TRACE_LAZY, TRACE_PARALLEL };
+
+typedef struct {
+    FILE* f;
+    int kind;          // TRACE_GENERATED, TRACE_LAZY or TRACE_PARALLEL, -1 = not a new game
+    int rooms, resident; // As passed to the generator; resident is the thread count of TRACE_PARALLEL
+    uint64_t seed;
+    int failed_turn;   // First turn that did not replay as recorded, 0 = none
+} Trace;
+
+// Records what inner decides, or replays the trace when inner is NULL
+typedef struct {
+    Policy base;
+    Policy* inner;
+    Trace* trace;
+} TracePolicy;
+
+// Independent fights laid out as arrays, one element per fight (see fight_batch)
+typedef struct {
+    int count;
+    int32_t *player_hp, *player_damage; // hp is updated in place
+    int32_t *monster_hp, *monster_damage;
+    uint8_t* monster_type;
+    Rng* rng; // One stream per fight
+    uint8_t* won; // Output: what fight() would return
+} FightBatch;
+
+// Exact odds of a fight (see fight_odds)
+typedef struct {
+    double win;     // Chance that the player survives it
+    double hp_left; // Expected player hp after it, when they do
+} FightOdds;
+
+// Compile with -DDUNGEON_ARENA=0 to use one malloc per object instead
+#ifndef DUNGEON_ARENA
+#define DUNGEON_ARENA 1
+#endif
+#define ARENA_ALIGN 8
+
+// Helper macros
+#define RAND_RANGE(rng, min, max) ((min) + rng_below((rng), (max) - (min) + 1))
+#define CLEAR_INPUT() while (getchar() != '\n')
+#define EMIT(d, ...) do { if ((d)->out) emit((d)->out, __VA_ARGS__, INT_MIN); } while (0)
+#define FOR_EACH_ROOM(d, r) \
+    for (int r##_id = 0; r##_id < (d)->num_rooms; r##_id++) \
+        for (Room* r = find_room_by_id((d), r##_id); r; r = NULL)
+
+// Instrumentation, build with -DDUNGEON_STATS (see stats_dump). Without it
+// every STAT_ macro is empty and costs nothing.
+#ifdef DUNGEON_STATS
+#define STAT_COUNTERS(X) \
+    X(find_room_calls) X(find_room_probes) X(rooms_connected_probes) \
+    X(door_draws) X(door_rejections) X(populate_attempts) X(fights) X(fight_rounds) X(batch_fights) \
+    X(save_bytes_written) X(load_bytes_read) X(load_bytes_mapped)
+#define STAT_SCOPES(X) X(other) X(generate) X(populate) X(save) X(load) X(graph)
+#define STAT_FIELD(name) atomic_long name;
+#define STAT_ENUM(name) STAT_##name,
+enum { STAT_SCOPES(STAT_ENUM) NUM_STAT_SCOPES };
+
+typedef struct {
+    STAT_COUNTERS(STAT_FIELD)
+    atomic_long allocs[NUM_STAT_SCOPES]; // Heap allocations made inside each scope
+    atomic_long calls[NUM_STAT_SCOPES], ns[NUM_STAT_SCOPES];
+} Stats;
+
+static Stats stats;
+static _Thread_local int stat_scope; // Innermost open scope, STAT_other outside all of them
+#define STAT_ADD(name, n) atomic_fetch_add_explicit(&stats.name, (n), memory_order_relaxed)
+#define STAT_BEGIN(scope) \
+    struct timespec stat_start_##scope; int stat_outer_##scope = stat_enter(STAT_##scope, &stat_start_##scope)
+#define STAT_END(scope) stat_leave(STAT_##scope, stat_outer_##scope, &stat_start_##scope)
+#else
+#define STAT_ADD(name, n) ((void)0)
+#define STAT_BEGIN(scope) ((void)0)
+#define STAT_END(scope) ((void)0)
+#endif
+
+// Function prototypes
+void sink_flush(Sink* s);
+void sink_printf(Sink* s, const char* fmt, ...);
+void emit(Sink* s, EventCode code, ...); // Arguments end with INT_MIN, see EMIT
+void* dungeon_alloc(Dungeon* d, size_t size);
+Dungeon* create_dungeon(int num_rooms);
+Room* create_room(Dungeon* d, int id, int max_doors);
+bool assign_door_rows(Dungeon* d);
+Monster create_monster(Dungeon* d, MonsterType type);
+Item create_item(Dungeon* d);
+bool connect_rooms(Dungeon* d, Room* a, Room* b);
+void graph_door_added(Dungeon* d, int a, int b);
+bool rooms_connected(Room* a, Room* b);
+Dungeon* generate_dungeon(int num_rooms, uint64_t seed);
+Dungeon* generate_dungeon_parallel(int num_rooms, uint64_t seed, int threads);
+void populate_rooms_parallel(Dungeon* d, int threads);
+int benchmark_generation(int max_rooms, uint64_t seed, int threads);
+void fight_batch(FightBatch* b);
+FightOdds fight_odds(int hp, int damage, const Monster* m);
+int benchmark_fights(int num_fights, uint64_t seed);
+int benchmark_suite(int max_rooms, uint64_t seed);
+void populate_rooms(Dungeon* d);
+void free_dungeon(Dungeon* d);
+bool save_game(Dungeon* d, const char* filename);
+bool journal_save(Dungeon* d, const char* filename);
+void journal_discard(Dungeon* d, const char* filename);
+bool journal_replay(Dungeon* d, const char* filename);
+void journal_touch(Dungeon* d, int id);
+Dungeon* load_game(const char* filename);
+Dungeon* load_game_mapped(const char* filename);
+void game_loop(Dungeon* d, Policy* p);
+StepResult game_step(Dungeon* d, Room* current, int action, int target);
+int interactive_action(Policy* p, Dungeon* d, Room* current);
+int interactive_door(Policy* p, Dungeon* d, Room* current);
+int random_action(Policy* p, Dungeon* d, Room* current);
+int random_door(Policy* p, Dungeon* d, Room* current);
+int explore_action(Policy* p, Dungeon* d, Room* current);
+int explore_door(Policy* p, Dungeon* d, Room* current);
+int safe_door(Policy* p, Dungeon* d, Room* current);
+int record_action(Policy* p, Dungeon* d, Room* current);
+int record_door(Policy* p, Dungeon* d, Room* current);
+int replay_action(Policy* p, Dungeon* d, Room* current);
+int replay_door(Policy* p, Dungeon* d, Room* current);
+uint32_t state_checksum(Dungeon* d);
+Trace* trace_create(const char* filename, const Trace* how);
+bool trace_finish(Trace* t, Dungeon* d);
+Dungeon* replay_trace(const char* filename, int stop, int* failed_turn);
+int replay_corpus(char** files, int count);
+int run_simulation(long games, int num_rooms, Policy* p, int threads, uint64_t seed);
+int run_quality(long maps, int rooms, int threads, uint64_t seed, const char* prefix);
+int run_coop(int players, int rooms, int turns, uint64_t seed);
+#ifdef HAVE_EPOLL
+int run_server(const char* path, int threads, OutMode mode);
+int run_client(const char* path, int sessions, int rooms, int turns, uint64_t seed, int connections);
+#endif
+Room* find_room_by_id(Dungeon* d, int id);
+Room* mapped_room(Dungeon* d, int id);
+Room* lazy_room(Dungeon* d, int id);
+Dungeon* generate_lazy_dungeon(int num_rooms, uint64_t seed, int resident);
+RoomGraph* dungeon_graph(Dungeon* d);
+int graph_distance(Dungeon* d, int id);
+int graph_treasure_path(Dungeon* d, int* path, int max);
+int graph_component(Dungeon* d, int id);
+bool graph_is_articulation(Dungeon* d, int id);
+bool graph_distances(Dungeon* d, const int* sources, int count, int32_t* out);
+int benchmark_graph(int num_rooms, uint64_t seed);
+#ifdef DUNGEON_STATS
+void stats_dump(FILE* f);
+void stats_init(void);
+#endif
+
+// Random numbers
+static uint64_t splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(Rng* r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&seed);
+}
+
+static inline uint64_t rng_next(Rng* r) {
+    uint64_t* s = r->s;
+    uint64_t x = s[1] * 5, result = ((x << 7) | (x >> 57)) * 9, t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+// Uniform in [0, n), by multiplying the top 32 bits instead of a modulo
+static inline int rng_below(Rng* r, int n) {
+    return (int)(((rng_next(r) >> 32) * (uint64_t)n) >> 32);
+}
+
+// Monster and item tables, see MONSTER_TYPES and ITEM_TYPES
+#define TYPE_INFO(id, ...) {__VA_ARGS__},
+const MonsterInfo monster_info[MAX_MONSTER_TYPES] = { MONSTER_TYPES(TYPE_INFO) };
+const ItemInfo item_info[MAX_ITEM_TYPES] = { ITEM_TYPES(TYPE_INFO) };
+#undef TYPE_INFO
+
+// Output
+// Game code reports events; the sink renders them as the Dutch prose, as CSV
+// rows or as fixed size binary records, into a buffer that is only written
+// out when it fills up and before every prompt.
+const char* event_names[NUM_EVENTS] = {
+    "start",          // room, loaded
+    "room",           // room, content type, monster/item type, cleared
+    "doors",          // room, count; followed by one door event per door
+    "door",           // target, last
+    "fight",          // monster type, player hp, player max hp, player damage
+    "monster",        // monster type, hp, damage
+    "special",        // monster type
+    "special_hit",    // damage, player hp, player max hp
+    "special_heal",   // monster hp, monster type
+    "pattern",        // pattern, 1 bit per attack, highest first (1 = player attacks)
+    "player_hit",     // monster type, damage, monster hp, monster hp before
+    "monster_hit",    // monster type, damage, player hp, player max hp
+    "round",          // monster type, player hp, player max hp, monster hp
+    "menu",
+    "move",           // target
+    "died",
+    "item",           // item type
+    "nothing",
+    "status",         // hp, max hp, damage, room, has treasure
+    "treasure",
+    "no_treasure",
+    "saved",          // ok
+    "autosave_failed",
+    "end",            // won
+    "danger",         // win chance in percent (rounded down), expected hp after a won fight
+};
+
+static void sink_drain(Sink* s) {
+    if (s->used && s->drain) s->drain(s, s->buf, s->used);
+    else if (s->used) fwrite(s->buf, 1, s->used, s->f);
+    s->used = 0;
+}
+
+void sink_flush(Sink* s) {
+    sink_drain(s);
+    if (s->f) fflush(s->f);
+}
+
+static void sink_write(Sink* s, const void* data, size_t len) {
+    if (s->used + len > OUT_BUFFER) sink_drain(s);
+    if (len > OUT_BUFFER) {
+        if (s->drain) s->drain(s, data, len);
+        else fwrite(data, 1, len, s->f);
+        return;
+    }
+    memcpy(s->buf + s->used, data, len);
+    s->used += len;
+}
+
+// Formats straight into the buffer; a line that does not fit drains it first
+static void sink_vprintf(Sink* s, const char* fmt, va_list ap) {
+    va_list retry;
+    va_copy(retry, ap);
+    size_t room = OUT_BUFFER - s->used;
+    int len = vsnprintf(s->buf + s->used, room, fmt, ap);
+    if (len >= 0 && (size_t)len < room) {
+        s->used += len;
+    } else if (len > 0) {
+        sink_drain(s);
+        if (len < OUT_BUFFER || s->drain) s->used = vsnprintf(s->buf, OUT_BUFFER, fmt, retry);
+        else vfprintf(s->f, fmt, retry);
+        if (s->used >= OUT_BUFFER) s->used = OUT_BUFFER - 1; // Cut short for a drain
+    }
+    va_end(retry);
+}
+
+// Free text, only shown in text mode (prompts, game start)
+void sink_printf(Sink* s, const char* fmt, ...) {
+    if (s->mode != OUT_TEXT) return;
+    va_list ap;
+    va_start(ap, fmt);
+    sink_vprintf(s, fmt, ap);
+    va_end(ap);
+}
+
+static void sink_text(Sink* s, EventCode code, const int32_t* a) {
+    const char* contents[] = {"De kamer is leeg", "Het lijk van een %s ligt op de grond", 
+                             "De lege schatkist staat hier", "De schat ligt hier!"};
+    switch (code) {
+        case EV_START:
+            if (a[1]) sink_printf(s, "\nSpel geladen, start in kamer %d\n", a[0]);
+            else sink_printf(s, "Start in kamer %d\n", a[0]);
+            break;
+        case EV_ROOM:
+            if (!a[3]) {
+                if (a[1] == MONSTER) sink_printf(s, "Er is een %s in de kamer\n", monster_info[a[2]].name);
+                else if (a[1] == ITEM) sink_printf(s, "Er ligt een %s op de grond\n", item_info[a[2]].name);
+                else if (a[1] == TREASURE) sink_printf(s, "%s\n", contents[3]);
+            } else {
+                sink_write(s, contents[a[1]], strlen(contents[a[1]]));
+                sink_write(s, "\n", 1);
+            }
+            break;
+        case EV_DOORS: sink_printf(s, "De kamer heeft deuren naar: "); break;
+        case EV_DOOR: sink_printf(s, a[1] ? "%d\n" : "%d, ", a[0]); break;
+        case EV_FIGHT: 
+            sink_printf(s, "\n=== Gevecht met %s ===\nHP: %d/%d, Damage: %d\n", 
+                        monster_info[a[0]].name, a[1], a[2], a[3]);
+            break;
+        case EV_MONSTER: sink_printf(s, "%s HP: %d, Damage: %d\n\n", monster_info[a[0]].name, a[1], a[2]); break;
+        case EV_SPECIAL: sink_printf(s, "%s\n", monster_info[a[0]].special); break;
+        case EV_SPECIAL_HIT: sink_printf(s, "Je verliest %d extra hp (%d/%d)\n", a[0], a[1], a[2]); break;
+        case EV_SPECIAL_HEAL: 
+            sink_printf(s, monster_info[a[1]].heal_text ? monster_info[a[1]].heal_text : "%d HP", a[0]);
+            sink_write(s, "\n", 1);
+            break;
+        case EV_PATTERN: {
+            char bits[] = "Aanval volgorde: 0000 (0 = monster valt aan, 1 = speler valt aan)\n";
+            for (int i = 0; i < 4; i++) bits[17 + i] = '0' + ((a[0] >> (3 - i)) & 1);
+            sink_write(s, bits, sizeof(bits) - 1);
+            break;
+        }
+        case EV_PLAYER_HIT:
+            sink_printf(s, "Jij valt de %s aan voor %d schade!\n%s verliest %d hp (%d/%d)\n", 
+                        monster_info[a[0]].name, a[1], monster_info[a[0]].name, a[1], a[2], a[3]);
+            break;
+        case EV_MONSTER_HIT:
+            sink_printf(s, "%s valt jou aan voor %d schade!\nJij verliest %d hp (%d/%d)\n", 
+                        monster_info[a[0]].name, a[1], a[1], a[2], a[3]);
+            break;
+        case EV_ROUND:
+            sink_printf(s, "\n=== Status na ronde ===\nHP: %d/%d\n%s HP: %d\n\n", 
+                        a[1], a[2], monster_info[a[0]].name, a[3]);
+            break;
+        case EV_MENU: sink_printf(s, "\n1. Verplaatsen\n2. Ruim kamer op\n3. Status\n4. Schat\n5. Opslaan\n6. Stoppen\n"); break;
+        case EV_MOVE: sink_printf(s, "Naar kamer %d\n", a[0]); break;
+        case EV_DIED: sink_printf(s, "Game Over!\n"); break;
+        case EV_ITEM: sink_printf(s, "Je gebruikt %s\n", item_info[a[0]].name); break;
+        case EV_NOTHING: sink_printf(s, "Niets om op te ruimen\n"); break;
+        case EV_STATUS:
+            sink_printf(s, "\n=== Status ===\nHP: %d/%d\nDamage: %d\nKamer: %d\n%s\n", 
+                        a[0], a[1], a[2], a[3], a[4] ? "Heeft schat" : "");
+            break;
+        case EV_TREASURE: sink_printf(s, "Je wint!\n"); break;
+        case EV_NO_TREASURE: sink_printf(s, "Geen schat hier\n"); break;
+        case EV_SAVED: sink_printf(s, a[0] ? "Opgeslagen!\n" : "Opslaan mislukt\n"); break;
+        case EV_AUTOSAVE_FAILED: sink_printf(s, "Automatisch opslaan mislukt\n"); break;
+        case EV_END: sink_printf(s, a[0] ? "\n*** Gewonnen! ***\n" : "\n*** Game Over ***\n"); break;
+        case EV_DANGER: sink_printf(s, "Kans om te winnen: %d%%, daarna gemiddeld %d HP\n", a[0], a[1]); break;
+        default: break;
+    }
+}
+
+// name,a1,...,a5 with the digits written by hand
+static void sink_csv(Sink* s, EventCode code, const int32_t* a) {
+    char line[128], *p = line;
+    size_t len = strlen(event_names[code]);
+    memcpy(p, event_names[code], len);
+    p += len;
+    for (int i = 0; i < EVENT_ARGS; i++) {
+        char digits[12];
+        int n = 0;
+        uint32_t v = a[i] < 0 ? 0u - (uint32_t)a[i] : (uint32_t)a[i];
+        do digits[n++] = '0' + v % 10; while (v /= 10);
+        *p++ = ',';
+        if (a[i] < 0) *p++ = '-';
+        while (n) *p++ = digits[--n];
+    }
+    *p++ = '\n';
+    sink_write(s, line, p - line);
+}
+
+// Missing arguments are 0; in binary mode every event is 21 bytes: the code,
+// then the arguments as little-endian int32
+void emit(Sink* s, EventCode code, ...) {
+    int32_t a[EVENT_ARGS] = {0};
+    int count = 0;
+    va_list ap;
+    va_start(ap, code);
+    for (int v; count < EVENT_ARGS && (v = va_arg(ap, int)) != INT_MIN; count++) a[count] = v;
+    va_end(ap);
+
+    if (s->mode == OUT_TEXT) {
+        sink_text(s, code, a);
+    } else if (s->mode == OUT_CSV) {
+        sink_csv(s, code, a);
+    } else {
+        unsigned char rec[1 + 4 * EVENT_ARGS], *p = rec + 1;
+        rec[0] = (unsigned char)code;
+        for (int i = 0; i < EVENT_ARGS; i++, p += 4) {
+            uint32_t v = (uint32_t)a[i];
+            p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+        }
+        sink_write(s, rec, sizeof(rec));
+    }
+}
+
+// Room state
+// Everything play changes in a room is one 64-bit word, so players on
+// different threads sharing a dungeon (see run_coop) change a room with a
+// single compare-and-swap from the state they saw. Whoever loses the race
+// reloads the word and decides again: of two players grabbing one item only
+// one gets it, and hits on a monster from several players all land.
+// A generation number changes whenever run_coop fills an emptied room, so a
+// fight against the old monster never hits the new one.
+//   bits 0-15 monster hp, 16-31 monster damage or item value (both signed,
+//   16 bits), 32-39 monster or item type, 40-41 ContentType, 42 cleared,
+//   43-63 generation
+#define STATE_CLEARED (1ull << 42)
+#define STATE_GEN_SHIFT 43
+
+// Whether v fits the 16-bit fields of the state; loaders reject what does not
+static inline bool state_fits(int64_t v) {
+    return v >= INT16_MIN && v <= INT16_MAX;
+}
+
+static inline uint16_t state_clamp(int v) {
+    return (uint16_t)(int16_t)(v < INT16_MIN ? INT16_MIN : v > INT16_MAX ? INT16_MAX : v);
+}
+
+static inline RoomState room_state(const Room* r) {
+    return atomic_load_explicit((_Atomic RoomState*)&r->state, memory_order_acquire);
+}
+
+static inline ContentType state_type(RoomState s) { return (ContentType)(s >> 40 & 3); }
+static inline bool state_cleared(RoomState s) { return s & STATE_CLEARED; }
+static inline int state_hp(RoomState s) { return (int16_t)s; }
+static inline uint64_t state_gen(RoomState s) { return s >> STATE_GEN_SHIFT; }
+
+// Something left to fight or take
+static inline bool state_present(RoomState s) {
+    return !state_cleared(s) && state_type(s) != EMPTY;
+}
+
+// The same monster as in seen, still in the room
+static inline bool state_same_monster(RoomState s, RoomState seen) {
+    return state_type(s) == MONSTER && !state_cleared(s) && state_gen(s) == state_gen(seen);
+}
+
+static inline RoomState state_with_hp(RoomState s, int hp) {
+    return (s & ~0xFFFFull) | state_clamp(hp);
+}
+
+static RoomState state_make(RoomContent c, bool cleared, uint64_t gen) {
+    uint64_t sub = 0, low = 0, high = 0;
+    if (c.type == MONSTER) {
+        sub = c.content.monster.type;
+        low = state_clamp(c.content.monster.hp);
+        high = state_clamp(c.content.monster.damage);
+    } else if (c.type == ITEM) {
+        sub = c.content.item.type;
+        high = state_clamp(c.content.item.value);
+    }
+    return low | high << 16 | (sub & 0xFF) << 32 | (uint64_t)c.type << 40 | (cleared ? STATE_CLEARED : 0) | 
+           gen << STATE_GEN_SHIFT;
+}
+
+static RoomContent state_content(RoomState s) {
+    RoomContent c = {.type = state_type(s)};
+    int sub = (int)(s >> 32 & 0xFF), high = (int16_t)(s >> 16);
+    if (c.type == MONSTER) c.content.monster = (Monster){sub, state_hp(s), high};
+    else if (c.type == ITEM) c.content.item = (Item){sub, high};
+    return c;
+}
+
+static inline RoomContent room_content(const Room* r) { return state_content(room_state(r)); }
+static inline ContentType room_type(const Room* r) { return state_type(room_state(r)); }
+static inline bool room_cleared(const Room* r) { return state_cleared(room_state(r)); }
+
+// Replaces content and flag at once, keeping the generation. Only for rooms
+// no other thread is changing: generation, loading and single-player setup.
+static inline void room_set(Room* r, RoomContent c, bool cleared) {
+    atomic_store_explicit(&r->state, state_make(c, cleared, state_gen(room_state(r))), memory_order_release);
+}
+
+// Moves r from seen to next; on a lost race seen is reloaded and false returned
+static inline bool room_cas(Dungeon* d, Room* r, RoomState* seen, RoomState next) {
+    if (atomic_compare_exchange_strong_explicit(&r->state, seen, next, memory_order_acq_rel, memory_order_acquire)) 
+        return true;
+    d->lost_races++;
+    return false;
+}
+
+// Sets cleared on r if it still holds what seen held. Exactly one player
+// clears a content, which is what counts as having used it up.
+static bool room_clear(Dungeon* d, Room* r, RoomState seen) {
+    RoomState now = room_state(r);
+    while (state_present(now) && state_type(now) == state_type(seen) && state_gen(now) == state_gen(seen)) {
+        if (room_cas(d, r, &now, now | STATE_CLEARED)) {
+            if (d->taken) d->taken[r->id]++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Game functions
+void print_room(Dungeon* d, Room* r) {
+    RoomState s = room_state(r);
+    RoomContent c = state_content(s);
+    int sub = c.type == MONSTER ? (int)c.content.monster.type : c.type == ITEM ? (int)c.content.item.type : 0;
+    EMIT(d, EV_ROOM, r->id, c.type, sub, state_cleared(s));
+    if (d->out && c.type == MONSTER && !state_cleared(s)) {
+        FightOdds odds = fight_odds(d->player.hp, d->player.damage, &c.content.monster);
+        EMIT(d, EV_DANGER, (int)(odds.win * 100), (int)(odds.hp_left + 0.5)); // 100% only when certain
+    }
+}
+
+void print_doors(Dungeon* d, Room* r) {
+    EMIT(d, EV_DOORS, r->id, r->num_doors);
+    for (int i = 0; i < r->num_doors; i++) EMIT(d, EV_DOOR, (int)r->doors[i], i == r->num_doors - 1);
+}
+
+// Adds delta to the hp of the monster seen in *seen, which is updated to the
+// room's new state; false when that monster has left the room
+static bool monster_hit(Dungeon* d, Room* r, RoomState* seen, int delta) {
+    RoomState now = room_state(r);
+    do {
+        if (!state_same_monster(now, *seen)) return false;
+    } while (!room_cas(d, r, &now, state_with_hp(now, state_hp(now) + delta)));
+    *seen = state_with_hp(now, state_hp(now) + delta);
+    return true;
+}
+
+// Fights the monster in r. Other players can fight it at the same time: their
+// hits show in its hp, and the fight is over for everyone once it is down.
+bool fight(Dungeon* d, Room* r) {
+    RoomState s = room_state(r);
+    Monster m = state_content(s).content.monster;
+    STAT_ADD(fights, 1);
+    EMIT(d, EV_FIGHT, m.type, d->player.hp, d->player.max_hp, d->player.damage);
+    EMIT(d, EV_MONSTER, m.type, m.hp, m.damage);
+
+    // 25% chance for special action
+    const MonsterInfo* info = &monster_info[m.type];
+    if (rng_below(&d->rng, 4) == 0 && info->special) {
+        EMIT(d, EV_SPECIAL, m.type);
+        if (info->special_damage) {
+            d->player.hp -= info->special_damage;
+            EMIT(d, EV_SPECIAL_HIT, info->special_damage, d->player.hp > 0 ? d->player.hp : 0, d->player.max_hp);
+        }
+        if (info->special_heal) {
+            if (!monster_hit(d, r, &s, info->special_heal)) return true;
+            m.hp = state_hp(s);
+            EMIT(d, EV_SPECIAL_HEAL, m.hp, m.type);
+        }
+    }
+
+    while (d->player.hp > 0 && m.hp > 0) {
+        int pattern = rng_below(&d->rng, 16);
+        STAT_ADD(fight_rounds, 1);
+        EMIT(d, EV_PATTERN, pattern);
+
+        for (int i = 3; i >= 0 && d->player.hp > 0 && m.hp > 0; i--) {
+            if ((pattern >> i) & 1) {
+                if (!monster_hit(d, r, &s, -d->player.damage)) return true;
+                m.hp = state_hp(s);
+                EMIT(d, EV_PLAYER_HIT, m.type, d->player.damage, m.hp > 0 ? m.hp : 0, m.hp + d->player.damage);
+                if (m.hp <= 0) return true;
+            } else {
+                // Only a monster that is still standing hits back
+                RoomState now = room_state(r);
+                if (!state_same_monster(now, s) || state_hp(now) <= 0) return true;
+                s = now;
+                m.hp = state_hp(now);
+                d->player.hp -= m.damage;
+                EMIT(d, EV_MONSTER_HIT, m.type, m.damage, d->player.hp > 0 ? d->player.hp : 0, d->player.max_hp);
+                if (d->player.hp <= 0) return false;
+            }
+        }
+
+        if (d->player.hp > 0 && m.hp > 0) {
+            EMIT(d, EV_ROUND, m.type, d->player.hp, d->player.max_hp, m.hp);
+            if (!d->headless) {
+                if (d->out) {
+                    sink_printf(d->out, "Druk op enter om door te gaan...");
+                    sink_flush(d->out);
+                }
+                CLEAR_INPUT(); getchar();
+            }
+        }
+    }
+    return true;
+}
+
+// Prompts and errors are only shown in text mode; out may be NULL
+int get_input(Sink* out, const char* prompt, int min, int max) {
+    int input;
+    while (1) {
+        if (out) {
+            sink_printf(out, "%s", prompt);
+            sink_flush(out);
+        }
+        if (scanf("%d", &input) != 1) {
+            CLEAR_INPUT();
+            if (out) sink_printf(out, "Voer een nummer tussen %d en %d in.\n", min, max);
+            continue;
+        }
+        CLEAR_INPUT();
+        if (input >= min && input <= max) return input;
+        if (out) sink_printf(out, "Ongeldige keuze. Kies tussen %d en %d.\n", min, max);
+    }
+}
+
+// Policies
+int interactive_action(Policy* p, Dungeon* d, Room* current) {
+    (void)p; (void)d; (void)current;
+    return get_input(d->out, "Keuze: ", 1, 6);
+}
+
+int interactive_door(Policy* p, Dungeon* d, Room* current) {
+    (void)p; (void)current;
+    return get_input(d->out, "Kies deur: ", 0, d->num_rooms-1);
+}
+
+int random_door(Policy* p, Dungeon* d, Room* current) {
+    (void)p; (void)d;
+    if (current->num_doors == 0) return current->id;
+    return current->doors[rng_below(&d->rng, current->num_doors)];
+}
+
+// Like random_door, but prefers rooms that have not been visited yet
+int explore_door(Policy* p, Dungeon* d, Room* current) {
+    if (current->num_doors == 0) return current->id;
+    int start = rng_below(&d->rng, current->num_doors);
+    for (int i = 0; i < current->num_doors; i++) {
+        int target = current->doors[(start + i) % current->num_doors];
+        if (!find_room_by_id(d, target)->visited) return target;
+    }
+    return random_door(p, d, current);
+}
+
+// Like explore_door, but stays out of rooms with a monster the player is
+// more likely to lose to than to beat, while there is another way
+int safe_door(Policy* p, Dungeon* d, Room* current) {
+    if (current->num_doors == 0) return current->id;
+    int start = rng_below(&d->rng, current->num_doors), safe = -1;
+    for (int i = 0; i < current->num_doors; i++) {
+        int target = current->doors[(start + i) % current->num_doors];
+        Room* r = find_room_by_id(d, target);
+        RoomContent c = room_content(r);
+        if (c.type == MONSTER && !room_cleared(r) && 
+            fight_odds(d->player.hp, d->player.damage, &c.content.monster).win < 0.5) continue;
+        if (!r->visited) return target;
+        if (safe < 0) safe = target;
+    }
+    return safe >= 0 ? safe : explore_door(p, d, current);
+}
+
+// Clears, picks up or moves at random
+int random_action(Policy* p, Dungeon* d, Room* current) {
+    (void)p; (void)d;
+    const int choices[] = {1, 1, 2, 4};
+    if (current->num_doors == 0) return rng_below(&d->rng, 2) ? 2 : 4;
+    return choices[rng_below(&d->rng, 4)];
+}
+
+// Takes the treasure when it is here, clears whatever is left, then moves on
+int explore_action(Policy* p, Dungeon* d, Room* current) {
+    (void)p; (void)d;
+    RoomState s = room_state(current);
+    if (!state_cleared(s) && state_type(s) == TREASURE) return 4;
+    if (state_present(s)) return 2;
+    return current->num_doors ? 1 : 6;
+}
+
+// Main game functions
+int main(int argc, char* argv[]) {
+    uint64_t seed = time(NULL);
+#ifdef DUNGEON_STATS
+    stats_init();
+#endif
+    
+    Dungeon* dungeon = NULL;
+    bool loaded = false;
+    Trace made = {.kind = -1}; // How a new game was made, for -r
+    
+    // In front of the other options: -j saves after every action, -z saves
+    // compressed, -e picks the output, -r records the session
+    static Sink out = {OUT_TEXT};
+    out.f = stdout;
+    bool autosave = false, compact = false;
+    const char* record = NULL;
+    while (argc > 1) {
+        int shift = 1;
+        if (strcmp(argv[1], "-j") == 0) {
+            autosave = true;
+        } else if (strcmp(argv[1], "-z") == 0) {
+            compact = true;
+        } else if (strcmp(argv[1], "-r") == 0 && argc > 2) {
+            record = argv[2];
+            shift = 2;
+        } else if (strcmp(argv[1], "-e") == 0 && argc > 2) {
+            if (strcmp(argv[2], "text") == 0) out.mode = OUT_TEXT;
+            else if (strcmp(argv[2], "csv") == 0) out.mode = OUT_CSV;
+            else if (strcmp(argv[2], "bin") == 0) out.mode = OUT_BINARY;
+            else {
+                printf("Onbekende uitvoer %s (text, csv of bin)\n", argv[2]);
+                return 1;
+            }
+            shift = 2;
+        } else {
+            break;
+        }
+        argv[shift] = argv[0];
+        argv += shift;
+        argc -= shift;
+    }
+    
+    if (argc > 1) {
+        if ((strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "-m") == 0) && argc > 2) {
+            // Load game mode, -m maps the save instead of reading it
+            dungeon = argv[1][1] == 'm' ? load_game_mapped(argv[2]) : load_game(argv[2]);
+            if (!dungeon) {
+                printf("Kon spel niet laden van %s\n", argv[2]);
+                return 1;
+            }
+            rng_seed(&dungeon->rng, seed);
+            loaded = true;
+        } else if (strcmp(argv[1], "-n") == 0 && argc > 2) {
+            // New game mode, an optional seed replays the same dungeon; with
+            // threads the dungeon is built in parallel and depends on their number too
+            int rooms = atoi(argv[2]);
+            if (argc > 3) seed = strtoull(argv[3], NULL, 10);
+            int threads = argc > 4 ? atoi(argv[4]) : 0;
+            if (rooms < 3 || (argc > 4 && threads < 1)) {
+                printf("Aantal kamers moet minstens 3 zijn, threads minstens 1\n");
+                return 1;
+            }
+            dungeon = threads ? generate_dungeon_parallel(rooms, seed, threads) : generate_dungeon(rooms, seed);
+            if (!dungeon) {
+                printf("Niet genoeg geheugen voor %d kamers\n", rooms);
+                return 1;
+            }
+            if (threads) populate_rooms_parallel(dungeon, threads);
+            else populate_rooms(dungeon);
+            made = (Trace){.kind = threads ? TRACE_PARALLEL : TRACE_GENERATED, .rooms = rooms, 
+                           .resident = threads, .seed = seed};
+            sink_printf(&out, "\nNieuw spel gestart met %d kamers (seed %llu)\n", rooms, (unsigned long long)seed);
+        } else if (strcmp(argv[1], "-i") == 0) {
+            // Lazily built dungeon: -i [kamers] [seed] [kamers in geheugen]
+            int rooms = argc > 2 ? atoi(argv[2]) : INT_MAX;
+            if (argc > 3) seed = strtoull(argv[3], NULL, 10);
+            int resident = argc > 4 ? atoi(argv[4]) : 0;
+            if (rooms < 3) {
+                printf("Aantal kamers moet minstens 3 zijn\n");
+                return 1;
+            }
+            dungeon = generate_lazy_dungeon(rooms, seed, resident);
+            if (!dungeon) {
+                printf("Niet genoeg geheugen\n");
+                return 1;
+            }
+            made = (Trace){.kind = TRACE_LAZY, .rooms = rooms, .resident = resident, .seed = seed};
+            sink_printf(&out, "\nNieuw spel gestart met %d kamers (seed %llu), %d in geheugen\n", 
+                        rooms, (unsigned long long)seed, dungeon->lazy->capacity);
+        } else if (strcmp(argv[1], "-p") == 0 && argc > 2) {
+            // Replay and check recorded sessions: -p <trace> ...
+            return replay_corpus(argv + 2, argc - 2);
+        } else if (strcmp(argv[1], "-t") == 0 && argc > 3) {
+            // Fast-forward a recorded session to a turn and play on from there: -t <beurt> <trace>
+            int turn = atoi(argv[2]), failed;
+            dungeon = replay_trace(argv[3], turn > 0 ? turn : 0, &failed);
+            if (!dungeon) {
+                if (failed) printf("%s wijkt af in beurt %d\n", argv[3], failed);
+                else printf("Kon trace niet lezen van %s\n", argv[3]);
+                return 1;
+            }
+            dungeon->headless = false;
+            sink_printf(&out, "\nBeurt %d van %s\n", dungeon->turns, argv[3]);
+            if (dungeon->player.hp <= 0 || dungeon->player.has_treasure) {
+                sink_flush(&out);
+                free_dungeon(dungeon);
+                return 0;
+            }
+#ifdef HAVE_EPOLL
+        } else if (strcmp(argv[1], "-S") == 0 && argc > 2) {
+            // Many games at once over a Unix socket: -S <socket> [workers]
+            return run_server(argv[2], argc > 3 ? atoi(argv[3]) : 0, out.mode);
+        } else if (strcmp(argv[1], "-C") == 0 && argc > 3) {
+            // Scripted client for -S: -C <socket> <sessies> [kamers] [beurten] [seed] [verbindingen]
+            int sessions = atoi(argv[3]);
+            int rooms = argc > 4 ? atoi(argv[4]) : 20;
+            int turns = argc > 5 ? atoi(argv[5]) : 50;
+            if (argc > 6) seed = strtoull(argv[6], NULL, 10);
+            int connections = argc > 7 ? atoi(argv[7]) : 1;
+            if (sessions < 1 || rooms < 3 || turns < 1 || connections < 1) {
+                printf("Minstens 1 sessie, 3 kamers, 1 beurt en 1 verbinding nodig\n");
+                return 1;
+            }
+            return run_client(argv[2], sessions, rooms, turns, seed, connections);
+#endif
+        } else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+            // Headless simulation: -s <spellen> [kamers] [explore|random|safe] [threads] [seed]
+            long games = atol(argv[2]);
+            int rooms = argc > 3 ? atoi(argv[3]) : 20;
+            bool random = argc > 4 && strcmp(argv[4], "random") == 0;
+            bool safe = argc > 4 && strcmp(argv[4], "safe") == 0;
+            int threads = argc > 5 ? atoi(argv[5]) : 0;
+            if (argc > 6) seed = strtoull(argv[6], NULL, 10);
+            if (games < 1 || rooms < 3) {
+                printf("Minstens 1 spel en 3 kamers nodig\n");
+                return 1;
+            }
+            Policy policy = random ? (Policy){random_action, random_door, 10 * rooms}
+                          : safe ? (Policy){explore_action, safe_door, 10 * rooms}
+                                 : (Policy){explore_action, explore_door, 10 * rooms};
+            return run_simulation(games, rooms, &policy, threads, seed);
+        } else if (strcmp(argv[1], "-q") == 0 && argc > 2) {
+            // Quality pipeline: -q <kaarten> [kamers] [threads] [seed] [prefix]
+            long maps = atol(argv[2]);
+            int rooms = argc > 3 ? atoi(argv[3]) : 50;
+            int threads = argc > 4 ? atoi(argv[4]) : 0;
+            if (argc > 5) seed = strtoull(argv[5], NULL, 10);
+            if (maps < 1 || rooms < 3) {
+                printf("Minstens 1 kaart en 3 kamers nodig\n");
+                return 1;
+            }
+            return run_quality(maps, rooms, threads, seed, argc > 6 ? argv[6] : NULL);
+        } else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+            // Co-op stress test: -c <spelers> [kamers] [beurten] [seed]
+            int players = atoi(argv[2]);
+            int rooms = argc > 3 ? atoi(argv[3]) : 20;
+            int turns = argc > 4 ? atoi(argv[4]) : 100000;
+            if (argc > 5) seed = strtoull(argv[5], NULL, 10);
+            if (players < 1 || rooms < 3 || turns < 1) {
+                printf("Minstens 1 speler, 3 kamers en 1 beurt nodig\n");
+                return 1;
+            }
+            return run_coop(players, rooms, turns, seed);
+        } else if (strcmp(argv[1], "-g") == 0) {
+            // Door generation benchmark: -g [max kamers] [seed] [threads]
+            int max_rooms = argc > 2 ? atoi(argv[2]) : 1000000;
+            if (argc > 3) seed = strtoull(argv[3], NULL, 10);
+            return benchmark_generation(max_rooms, seed, argc > 4 ? atoi(argv[4]) : 0);
+        } else if (strcmp(argv[1], "-f") == 0) {
+            // Batch combat check and benchmark: -f [gevechten] [seed]
+            int fights = argc > 2 ? atoi(argv[2]) : 1000000;
+            if (argc > 3) seed = strtoull(argv[3], NULL, 10);
+            return benchmark_fights(fights > 0 ? fights : 1, seed);
+        } else if (strcmp(argv[1], "-a") == 0 && argc > 2) {
+            // Graph analytics and their checks: -a <kamers> [seed]
+            int rooms = atoi(argv[2]);
+            if (argc > 3) seed = strtoull(argv[3], NULL, 10);
+            if (rooms < 3) {
+                printf("Aantal kamers moet minstens 3 zijn\n");
+                return 1;
+            }
+            return benchmark_graph(rooms, seed);
+        } else if (strcmp(argv[1], "-b") == 0) {
+            // Benchmark suite as JSON: -b [max kamers] [seed]
+            int max_rooms = argc > 2 ? atoi(argv[2]) : 100000;
+            seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+            return benchmark_suite(max_rooms, seed);
+        } else {
+            printf("Usage:\n%s -n <aantal kamers> [seed] [threads] - Nieuw spel\n%s -l <bestandsnaam> - Laad spel\n"
+                   "%s -m <bestandsnaam> - Laad spel via mmap\n"
+                   "%s -i [kamers] [seed] [kamers in geheugen] - Nieuw spel, kamers pas bij gebruik gemaakt\n"
+                   "%s -s <spellen> [kamers] [explore|random|safe] [threads] [seed] - Simulatie zonder uitvoer\n"
+                   "%s -q <kaarten> [kamers] [threads] [seed] [prefix] - Kaarten keuren, goede als <prefix><seed>.dat\n"
+                   "%s -c <spelers> [kamers] [beurten] [seed] - Stresstest met spelers samen in een dungeon\n"
+                   "%s -g [max kamers] [seed] [threads] - Benchmark generatie\n"
+                   "%s -f [gevechten] [seed] - Batch-gevechten controleren en meten\n"
+                   "%s -a <kamers> [seed] - Graafanalyse van de kamers\n"
+                   "%s -b [max kamers] [seed] - Benchmarks als JSON\n"
+                   "%s -j <optie> ... - Na elke actie opslaan in dungeon_save.dat\n"
+                   "%s -z <optie> ... - Gecomprimeerd opslaan\n"
+                   "%s -e <text|csv|bin> <optie> ... - Spel als tekst, CSV- of binaire gebeurtenissen\n"
+                   "%s -r <trace> <optie> ... - Nieuw spel opnemen\n"
+                   "%s -p <trace> ... - Opgenomen spellen afspelen en controleren\n"
+                   "%s -t <beurt> <trace> - Opgenomen spel tot een beurt afspelen, daarna zelf verder\n"
+                   "%s -S <socket> [workers] - Server voor veel spellen tegelijk\n"
+                   "%s -C <socket> <sessies> [kamers] [beurten] [seed] [verbindingen] - Testclient voor -S\n", 
+                   argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], 
+                   argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    } else {
+        // Interactive mode if no arguments
+        sink_printf(&out, "=== Dungeon Adventure ===\n1. Nieuw spel\n2. Laad spel\n");
+        int choice = get_input(&out, "Keuze: ", 1, 2);
+        
+        if (choice == 1) {
+            int rooms = get_input(&out, "Aantal kamers (3-20): ", 3, 20);
+            dungeon = generate_dungeon(rooms, seed);
+            populate_rooms(dungeon);
+            made = (Trace){.kind = TRACE_GENERATED, .rooms = rooms, .seed = seed};
+            sink_printf(&out, "\n");
+        } else {
+            dungeon = load_game("dungeon_save.dat");
+            if (dungeon) rng_seed(&dungeon->rng, seed);
+            loaded = dungeon != NULL;
+            if (!dungeon) {
+                sink_printf(&out, "Nieuw spel starten...\n");
+                int rooms = get_input(&out, "Aantal kamers (3-20): ", 3, 20);
+                dungeon = generate_dungeon(rooms, seed);
+                populate_rooms(dungeon);
+                made = (Trace){.kind = TRACE_GENERATED, .rooms = rooms, .seed = seed};
+                sink_printf(&out, "\n");
+            }
+        }
+    }
+
+    Trace* trace = NULL;
+    if (record && (made.kind < 0 || !(trace = trace_create(record, &made)))) {
+        if (made.kind < 0) printf("Alleen een nieuw spel kan opgenomen worden\n");
+        else printf("Kon %s niet aanmaken\n", record);
+        free_dungeon(dungeon);
+        return 1;
+    }
+
+    // Show starting room
+    dungeon->out = &out;
+    EMIT(dungeon, EV_START, dungeon->player.current_room_id, loaded);
+    Room* current = find_room_by_id(dungeon, dungeon->player.current_room_id);
+    print_room(dungeon, current);
+    print_doors(dungeon, current);
+    
+    Policy player = {interactive_action, interactive_door, 0};
+    TracePolicy recorder = {{record_action, record_door, 0}, &player, trace};
+    if (autosave) dungeon->autosave = "dungeon_save.dat";
+    if (compact) dungeon->compact = true;
+    game_loop(dungeon, trace ? &recorder.base : &player);
+    sink_flush(&out);
+    if (trace && !trace_finish(trace, dungeon)) printf("Opnemen in %s mislukt\n", record);
+    free_dungeon(dungeon);
+    return 0;
+}
+
+static void use_item(Player* pl, const Item* it) {
+    switch(item_info[it->type].effect) {
+        case EFFECT_HEAL:
+            pl->hp = (pl->hp += it->value) > pl->max_hp ? pl->max_hp : pl->hp;
+            break;
+        case EFFECT_DAMAGE: pl->damage += it->value; break;
+        case EFFECT_MAX_HP: 
+            pl->max_hp += it->value;
+            pl->hp += it->value;
+            break;
+    }
+}
+
+// One menu action on the player's room; target is the room to move to for
+// action 1. Taking the treasure ends the game as well, see has_treasure.
+StepResult game_step(Dungeon* d, Room* current, int action, int target) {
+    switch(action) {
+        case 1: {
+            for (int i = 0; i < current->num_doors; i++) {
+                if ((int)current->doors[i] == target) {
+                    d->player.current_room_id = target;
+                    journal_touch(d, target);
+                    EMIT(d, EV_MOVE, target);
+                    Room* new_room = find_room_by_id(d, target);
+                    print_room(d, new_room);
+                    RoomState s = room_state(new_room);
+                    if (state_type(s) == MONSTER && !state_cleared(s) && !fight(d, new_room)) {
+                        EMIT(d, EV_DIED);
+                        return STEP_DIED;
+                    }
+                    break;
+                }
+            }
+            break;
+        }
+        case 2: {
+            RoomState s = room_state(current);
+            // Of several players taking the item only the first CAS gets it
+            while (state_type(s) == ITEM && !state_cleared(s) && 
+                   !room_cas(d, current, &s, state_make((RoomContent){EMPTY}, true, state_gen(s))));
+            if (state_type(s) == MONSTER && !state_cleared(s)) {
+                if (!fight(d, current)) {
+                    EMIT(d, EV_DIED);
+                    return STEP_DIED;
+                }
+                room_clear(d, current, s);
+            } else if (state_type(s) == ITEM && !state_cleared(s)) {
+                Item it = state_content(s).content.item;
+                use_item(&d->player, &it);
+                EMIT(d, EV_ITEM, it.type);
+                if (d->taken) d->taken[current->id]++;
+            } else {
+                EMIT(d, EV_NOTHING);
+            }
+            break;
+        }
+        case 3: {
+            EMIT(d, EV_STATUS, d->player.hp, d->player.max_hp, d->player.damage, 
+                 d->player.current_room_id, d->player.has_treasure);
+            break;
+        }
+        case 4: {
+            RoomState s = room_state(current);
+            if (state_type(s) == TREASURE && room_clear(d, current, s)) {
+                EMIT(d, EV_TREASURE);
+                d->player.has_treasure = true;
+            } else {
+                EMIT(d, EV_NO_TREASURE);
+            }
+            break;
+        }
+        case 5: {
+            // A full save, unless -j keeps a journal next to it
+            EMIT(d, EV_SAVED, d->autosave ? journal_save(d, d->autosave) : save_game(d, "dungeon_save.dat"));
+            break;
+        }
+        case 6: return STEP_QUIT;
+    }
+    return STEP_CONTINUE;
+}
+
+void game_loop(Dungeon* d, Policy* p) {
+    while (d->player.hp > 0 && !d->player.has_treasure) {
+        Room* current = find_room_by_id(d, d->player.current_room_id);
+        current->visited = true;
+        journal_touch(d, current->id); // Actions only change this room and the one moved into
+        if (p->max_turns && d->turns >= p->max_turns) return;
+        d->turns++;
+        EMIT(d, EV_MENU);
+        int action = p->choose_action(p, d, current), target = -1;
+        if (action == 1) {
+            print_doors(d, current);
+            target = p->choose_door(p, d, current);
+        }
+        if (game_step(d, current, action, target) != STEP_CONTINUE) return;
+        if (d->autosave && !journal_save(d, d->autosave)) EMIT(d, EV_AUTOSAVE_FAILED);
+    }
+    EMIT(d, EV_END, d->player.has_treasure);
+}
+
+// Allocation counting
+// Every heap allocation made for a dungeon or a save goes through these, so
+// the benchmark suite can report allocations per operation.
+static atomic_long heap_allocs;
+
+static void* counted_malloc(size_t size) {
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    STAT_ADD(allocs[stat_scope], 1);
+    return malloc(size);
+}
+
+static void* counted_calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    STAT_ADD(allocs[stat_scope], 1);
+    return calloc(n, size);
+}
+
+// Instrumentation
+// Counters are relaxed atomics, so simulation workers can share them. A scope
+// charges the heap allocations made inside it to itself and adds its wall
+// time to its timer; nested scopes count towards both.
+#ifdef DUNGEON_STATS
+static int stat_enter(int scope, struct timespec* start) {
+    int outer = stat_scope;
+    stat_scope = scope;
+    clock_gettime(CLOCK_MONOTONIC, start);
+    return outer;
+}
+
+static void stat_leave(int scope, int outer, const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    STAT_ADD(calls[scope], 1);
+    STAT_ADD(ns[scope], (end.tv_sec - start->tv_sec) * 1000000000L + end.tv_nsec - start->tv_nsec);
+    stat_scope = outer;
+}
+
+void stats_dump(FILE* f) {
+    const char* sep = "";
+    fprintf(f, "{\n  \"counters\": {");
+#define STAT_JSON_COUNTER(name) \
+    fprintf(f, "%s\n    \"" #name "\": %ld", sep, atomic_load(&stats.name)); sep = ",";
+    STAT_COUNTERS(STAT_JSON_COUNTER)
+#undef STAT_JSON_COUNTER
+    const char* scopes[] = {
+#define STAT_NAME(name) #name,
+        STAT_SCOPES(STAT_NAME)
+#undef STAT_NAME
+    };
+    fprintf(f, "\n  },\n  \"allocs\": {");
+    for (int i = 0; i < NUM_STAT_SCOPES; i++) 
+        fprintf(f, "%s\n    \"%s\": %ld", i ? "," : "", scopes[i], atomic_load(&stats.allocs[i]));
+    fprintf(f, "\n  },\n  \"timers\": {");
+    for (int i = 1; i < NUM_STAT_SCOPES; i++) 
+        fprintf(f, "%s\n    \"%s\": {\"calls\": %ld, \"ms\": %.3f}", i > 1 ? "," : "", scopes[i], 
+                atomic_load(&stats.calls[i]), atomic_load(&stats.ns[i]) / 1e6);
+    fprintf(f, "\n  }\n}\n");
+    fflush(f);
+}
+
+static void stats_dump_at_exit(void) {
+    stats_dump(stderr);
+}
+
+#ifdef HAVE_PTHREAD
+// SIGUSR1 is blocked in every thread and taken here with sigwait, so the
+// dump runs as ordinary code instead of inside a signal handler
+static void* stats_signal_thread(void* arg) {
+    sigset_t* set = arg;
+    for (int sig; sigwait(set, &sig) == 0; ) stats_dump(stderr);
+    return NULL;
+}
+#endif
+
+// Dumps to stderr at exit and on SIGUSR1; call before any thread is started
+void stats_init(void) {
+    atexit(stats_dump_at_exit);
+#ifdef HAVE_PTHREAD
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_t tid;
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) == 0 && 
+        pthread_create(&tid, NULL, stats_signal_thread, &set) == 0) 
+        pthread_detach(tid);
+#endif
+}
+#endif
+
+// Headless simulation
+// Plays whole games without any output or prompts and only keeps counters;
+// the report is formatted once, after the last game.
+#define SIM_HP_BUCKETS 21 // Final hp in steps of 10, the last bucket is 200+
+
+typedef struct {
+    long games, wins, deaths, quits;
+    long turns, hp_total;
+    long hp_hist[SIM_HP_BUCKETS]; // Dead players count in bucket 0
+} SimStats;
+
+void simulate_game(int num_rooms, uint64_t seed, Policy* p, SimStats* s) {
+    Dungeon* d = generate_dungeon(num_rooms, seed);
+    if (!d) return;
+    populate_rooms(d);
+    d->headless = true;
+    game_loop(d, p);
+
+    int hp = d->player.hp > 0 ? d->player.hp : 0;
+    s->games++;
+    s->turns += d->turns;
+    s->hp_total += hp;
+    s->hp_hist[hp / 10 < SIM_HP_BUCKETS ? hp / 10 : SIM_HP_BUCKETS - 1]++;
+    if (d->player.has_treasure) s->wins++;
+    else if (d->player.hp <= 0) s->deaths++;
+    else s->quits++;
+    free_dungeon(d);
+}
+
+void merge_sim_stats(SimStats* into, const SimStats* s) {
+    into->games += s->games;
+    into->wins += s->wins;
+    into->deaths += s->deaths;
+    into->quits += s->quits;
+    into->turns += s->turns;
+    into->hp_total += s->hp_total;
+    for (int i = 0; i < SIM_HP_BUCKETS; i++) into->hp_hist[i] += s->hp_hist[i];
+}
+
+void print_sim_stats(const SimStats* s, double seconds) {
+    if (s->games == 0) return;
+    printf("=== Simulatie ===\n");
+    printf("Spellen: %ld (%.0f spellen/s)\n", s->games, seconds > 0 ? s->games / seconds : 0.0);
+    printf("Gewonnen: %ld (%.1f%%), dood: %ld (%.1f%%), gestopt: %ld (%.1f%%)\n", 
+           s->wins, 100.0 * s->wins / s->games, s->deaths, 100.0 * s->deaths / s->games, 
+           s->quits, 100.0 * s->quits / s->games);
+    printf("Beurten per spel: %.2f\n", (double)s->turns / s->games);
+    printf("HP aan het eind: gemiddeld %.1f\n", (double)s->hp_total / s->games);
+    for (int i = 0; i < SIM_HP_BUCKETS; i++) {
+        if (!s->hp_hist[i]) continue;
+        if (i == SIM_HP_BUCKETS - 1) printf("  %3d+    ", i * 10);
+        else printf("  %3d-%-3d ", i * 10, i * 10 + 9);
+        printf("%ld (%.1f%%)\n", s->hp_hist[i], 100.0 * s->hp_hist[i] / s->games);
+    }
+}
+
+// Worker pool
+// Game i is always played with seed + i, whichever thread claims it, and the
+// per-thread counters are only summed at the end, so the report depends on
+// the seed alone and not on the thread count or scheduling.
+#define SIM_BATCH 64 // Games claimed per atomic increment
+
+typedef struct {
+    long games;
+    int num_rooms;
+    Policy* policy;
+    uint64_t seed;
+    atomic_long next; // First game not claimed by a worker yet
+} SimJob;
+
+typedef struct {
+    SimJob* job;
+    SimStats stats;
+} SimWorker;
+
+static void* sim_worker(void* arg) {
+    SimWorker* w = arg;
+    SimJob* job = w->job;
+    for (;;) {
+        long start = atomic_fetch_add(&job->next, SIM_BATCH);
+        if (start >= job->games) break;
+        long end = start + SIM_BATCH < job->games ? start + SIM_BATCH : job->games;
+        for (long i = start; i < end; i++) 
+            simulate_game(job->num_rooms, job->seed + i, job->policy, &w->stats);
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// threads <= 0 uses one worker per online CPU
+int run_simulation(long games, int num_rooms, Policy* p, int threads, uint64_t seed) {
+    SimJob job = {games, num_rooms, p, seed, 0};
+    SimStats total = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef HAVE_PTHREAD
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    SimWorker* workers = calloc(threads, sizeof(SimWorker));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    if (!workers || !tids) {
+        free(workers);
+        free(tids);
+        return 1;
+    }
+    // Thread 0 is the calling thread
+    for (int i = 0; i < threads; i++) workers[i].job = &job;
+    int started = 1;
+    while (started < threads && pthread_create(&tids[started], NULL, sim_worker, &workers[started]) == 0) 
+        started++;
+    sim_worker(&workers[0]);
+    for (int i = 1; i < started; i++) pthread_join(tids[i], NULL);
+    for (int i = 0; i < started; i++) merge_sim_stats(&total, &workers[i].stats);
+    free(workers);
+    free(tids);
+#else
+    int started = threads = 1;
+    SimWorker w = {&job, {0}};
+    sim_worker(&w);
+    total = w.stats;
+#endif
+
+    double seconds = elapsed_seconds(&start);
+    printf("Seed %llu, %d threads\n", (unsigned long long)seed, started);
+    print_sim_stats(&total, seconds);
+    return total.games == games ? 0 : 1;
+}
+
+// Quality pipeline
+// -q streams seeds through four stages that run at the same time, joined by
+// bounded queues: generate (generate_dungeon and populate_rooms), analyze
+// (MapScore), filter (QualityFilter) and save. A full queue stalls the stage
+// in front of it, so at most QUALITY_QUEUE maps wait between two stages
+// whatever their speeds. Map i uses seed + i, as in the simulation, and the
+// accepted seeds are printed sorted, so the output depends on the seed alone.
+#define QUALITY_QUEUE 64
+
+typedef struct {
+    int distance;    // Doors from the entrance to the treasure, -1 = unreachable
+    int monsters, items;
+    double survival; // Chance to survive every monster on a shortest path to the treasure
+    double damage;   // Expected hp lost to them
+    int item_value;  // Total value of the items reachable without a fight
+} MapScore;
+
+typedef struct {
+    int min_distance;
+    double min_ratio, max_ratio; // Monsters per item
+    double min_survival;
+} QualityFilter;
+
+static const QualityFilter default_quality = {3, 0.5, 2.0, 0.5};
+
+typedef struct {
+    uint64_t seed;
+    Dungeon* d;
+    MapScore score;
+} QualityMap;
+
+typedef enum { STAGE_GENERATE, STAGE_ANALYZE, STAGE_FILTER, STAGE_SAVE, NUM_STAGES } QualityStage;
+static const char* stage_names[NUM_STAGES] = {"genereren", "analyseren", "filteren", "opslaan"};
+
+// Scratch of one analyze thread, sized for the job's room count
+typedef struct {
+    int32_t* path;
+    int32_t* queue;
+    uint32_t* seen; // Rooms queued in the search with this stamp
+    uint32_t stamp;
+} QualityScratch;
+
+typedef struct {
+    long maps;
+    int rooms;
+    uint64_t seed;
+    const char* prefix; // Accepted maps are saved as <prefix><seed>.dat, NULL = not saved
+    QualityFilter filter;
+    atomic_long next;   // First map not claimed by a generate thread
+    atomic_long failed; // Maps that could not be generated
+    long rejected[3];   // By the first test failed: distance, ratio, survival
+    long num_accepted, accepted_cap, save_errors;
+    uint64_t* accepted; // Seeds, sorted once the pipeline is done
+    MapScore sum;       // Totals over the accepted maps
+    double survival_sum, damage_sum;
+    double busy[NUM_STAGES]; // Seconds spent working, summed over the stage's threads
+    int threads[NUM_STAGES];
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock; // Guards busy
+#endif
+} QualityJob;
+
+static bool quality_generate(QualityJob* job, long i, QualityMap* map) {
+    map->seed = job->seed + i;
+    map->d = generate_dungeon(job->rooms, map->seed);
+    if (!map->d) {
+        atomic_fetch_add(&job->failed, 1);
+        return false;
+    }
+    populate_rooms(map->d);
+    return true;
+}
+
+static void quality_analyze(QualityMap* map, QualityScratch* s) {
+    Dungeon* d = map->d;
+    MapScore* score = &map->score;
+    *score = (MapScore){-1, 0, 0, 0, 0, 0};
+    FOR_EACH_ROOM(d, r) {
+        score->monsters += room_type(r) == MONSTER;
+        score->items += room_type(r) == ITEM;
+    }
+
+    // Fights along the path in order, each starting from the expected hp of the one before
+    int len = graph_treasure_path(d, s->path, d->num_rooms);
+    if (len > 0) {
+        score->distance = len - 1;
+        score->survival = 1;
+        double hp = d->player.hp;
+        for (int i = 0; i < len; i++) {
+            Room* r = find_room_by_id(d, s->path[i]);
+            RoomContent c = room_content(r);
+            if (c.type != MONSTER || room_cleared(r)) continue;
+            FightOdds odds = fight_odds((int)(hp + 0.5), d->player.damage, &c.content.monster);
+            score->survival *= odds.win;
+            score->damage += hp - odds.hp_left;
+            hp = odds.hp_left;
+        }
+    }
+
+    // Search from the entrance that stops at every room with a monster
+    if (++s->stamp == 0) {
+        memset(s->seen, 0, d->num_rooms * sizeof(uint32_t));
+        s->stamp = 1;
+    }
+    int n = 0;
+    s->queue[n++] = d->entrance->id;
+    s->seen[d->entrance->id] = s->stamp;
+    for (int k = 0; k < n; k++) {
+        Room* r = find_room_by_id(d, s->queue[k]);
+        RoomContent c = room_content(r);
+        if (c.type == MONSTER && !room_cleared(r)) continue;
+        if (c.type == ITEM) score->item_value += c.content.item.value;
+        for (int j = 0; j < r->num_doors; j++) {
+            int t = r->doors[j];
+            if (s->seen[t] == s->stamp) continue;
+            s->seen[t] = s->stamp;
+            s->queue[n++] = t;
+        }
+    }
+}
+
+// Frees rejected maps; the filter stage has one thread, so the counters need no lock
+static bool quality_filter(QualityJob* job, QualityMap* map) {
+    const MapScore* s = &map->score;
+    const QualityFilter* f = &job->filter;
+    double ratio = s->items ? (double)s->monsters / s->items : f->max_ratio + 1;
+    int failed = s->distance < f->min_distance ? 0 
+               : ratio < f->min_ratio || ratio > f->max_ratio ? 1 
+               : s->survival < f->min_survival ? 2 : -1;
+    if (failed < 0) return true;
+    job->rejected[failed]++;
+    free_dungeon(map->d);
+    return false;
+}
+
+static void quality_save(QualityJob* job, QualityMap* map) {
+    if (job->prefix) {
+        char name[FILENAME_MAX];
+        bool ok = snprintf(name, sizeof(name), "%s%llu.dat", job->prefix, (unsigned long long)map->seed) 
+                  < (int)sizeof(name);
+        job->save_errors += !(ok && save_game(map->d, name));
+    }
+    if (job->num_accepted == job->accepted_cap) {
+        long cap = job->accepted_cap ? job->accepted_cap * 2 : 1024;
+        uint64_t* seeds = realloc(job->accepted, cap * sizeof(uint64_t));
+        if (seeds) {
+            job->accepted = seeds;
+            job->accepted_cap = cap;
+        }
+    }
+    if (job->num_accepted < job->accepted_cap) job->accepted[job->num_accepted++] = map->seed;
+    job->sum.distance += map->score.distance;
+    job->sum.monsters += map->score.monsters;
+    job->sum.items += map->score.items;
+    job->sum.item_value += map->score.item_value;
+    job->survival_sum += map->score.survival;
+    job->damage_sum += map->score.damage;
+    free_dungeon(map->d);
+}
+
+static bool quality_scratch_init(QualityScratch* s, int rooms) {
+    s->path = malloc(rooms * sizeof(int32_t));
+    s->queue = malloc(rooms * sizeof(int32_t));
+    s->seen = calloc(rooms, sizeof(uint32_t));
+    s->stamp = 0;
+    return s->path && s->queue && s->seen;
+}
+
+static void quality_scratch_free(QualityScratch* s) {
+    free(s->path);
+    free(s->queue);
+    free(s->seen);
+}
+
+#ifdef HAVE_PTHREAD
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    QualityMap items[QUALITY_QUEUE];
+    int head, count;
+    int producers; // Threads still pushing; once none are left an empty queue is done
+} MapQueue;
+
+static void map_queue_init(MapQueue* q, int producers) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->head = q->count = 0;
+    q->producers = producers;
+}
+
+static void map_queue_destroy(MapQueue* q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+static void map_queue_push(MapQueue* q, const QualityMap* map) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == QUALITY_QUEUE) pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count++) % QUALITY_QUEUE] = *map;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// False once the queue is empty and every producer is done
+static bool map_queue_pop(MapQueue* q, QualityMap* map) {
+    pthread_mutex_lock(&q->lock);
+    while (!q->count && q->producers) pthread_cond_wait(&q->not_empty, &q->lock);
+    bool got = q->count > 0;
+    if (got) {
+        *map = q->items[q->head];
+        q->head = (q->head + 1) % QUALITY_QUEUE;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+static void map_queue_close(MapQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->producers--;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+typedef struct {
+    QualityJob* job;
+    QualityStage stage;
+    MapQueue *in, *out; // in is NULL for generate, out is NULL for save
+    pthread_t tid;
+    bool running;
+} StageThread;
+
+static void* quality_stage(void* arg) {
+    StageThread* t = arg;
+    QualityJob* job = t->job;
+    QualityScratch scratch = {0};
+    bool ok = t->stage != STAGE_ANALYZE || quality_scratch_init(&scratch, job->rooms);
+    double busy = 0;
+    QualityMap map;
+    for (;;) {
+        long i = 0;
+        if (t->in) {
+            if (!map_queue_pop(t->in, &map)) break;
+        } else if ((i = atomic_fetch_add(&job->next, 1)) >= job->maps) {
+            break;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool pass = true;
+        switch (t->stage) {
+            case STAGE_GENERATE: pass = quality_generate(job, i, &map); break;
+            case STAGE_ANALYZE:
+                // Without scratch memory every map goes through unscored, and is rejected
+                if (ok) quality_analyze(&map, &scratch);
+                else map.score = (MapScore){-1, 0, 0, 0, 0, 0};
+                break;
+            case STAGE_FILTER: pass = quality_filter(job, &map); break;
+            case STAGE_SAVE: quality_save(job, &map); break;
+            default: break;
+        }
+        busy += elapsed_seconds(&start);
+        if (pass && t->out) map_queue_push(t->out, &map);
+    }
+    if (t->out) map_queue_close(t->out);
+    quality_scratch_free(&scratch);
+    pthread_mutex_lock(&job->lock);
+    job->busy[t->stage] += busy;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+#endif
+
+static int compare_seeds(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// threads <= 0 uses one thread per online CPU; generate and analyze split
+// them, filter and save always have one
+int run_quality(long maps, int rooms, int threads, uint64_t seed, const char* prefix) {
+    QualityJob job = {.maps = maps, .rooms = rooms, .seed = seed, .prefix = prefix, .filter = default_quality};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef HAVE_PTHREAD
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 2) threads = 2;
+    job.threads[STAGE_GENERATE] = threads - threads / 2;
+    job.threads[STAGE_ANALYZE] = threads / 2;
+    job.threads[STAGE_FILTER] = job.threads[STAGE_SAVE] = 1;
+    pthread_mutex_init(&job.lock, NULL);
+    MapQueue queues[NUM_STAGES - 1];
+    for (int s = 0; s < NUM_STAGES - 1; s++) map_queue_init(&queues[s], job.threads[s]);
+
+    int total = 0;
+    for (int s = 0; s < NUM_STAGES; s++) total += job.threads[s];
+    StageThread* stages = calloc(total, sizeof(StageThread));
+    if (!stages) return 1;
+
+    // Consumers start before their producers. A thread that does not start
+    // closes its queue as if it were done; a stage without any thread stops
+    // the stages in front of it from starting, and the rest drains.
+    bool stopped = false;
+    for (int s = NUM_STAGES - 1, k = total; s >= 0; s--) {
+        int running = 0;
+        for (int n = 0; n < job.threads[s]; n++) {
+            StageThread* t = &stages[--k];
+            *t = (StageThread){.job = &job, .stage = s, .in = s ? &queues[s - 1] : NULL, 
+                               .out = s < NUM_STAGES - 1 ? &queues[s] : NULL};
+            t->running = !stopped && pthread_create(&t->tid, NULL, quality_stage, t) == 0;
+            running += t->running;
+            if (!t->running && t->out) map_queue_close(t->out);
+        }
+        if (!running && !stopped) {
+            printf("Kon geen thread starten voor %s\n", stage_names[s]);
+            stopped = true;
+        }
+    }
+    for (int k = 0; k < total; k++) if (stages[k].running) pthread_join(stages[k].tid, NULL);
+    for (int s = 0; s < NUM_STAGES - 1; s++) map_queue_destroy(&queues[s]);
+    pthread_mutex_destroy(&job.lock);
+    free(stages);
+    if (stopped) {
+        free(job.accepted);
+        return 1;
+    }
+#else
+    (void)threads;
+    for (int s = 0; s < NUM_STAGES; s++) job.threads[s] = 1;
+    QualityScratch scratch;
+    if (!quality_scratch_init(&scratch, rooms)) return 1;
+    for (long i = 0; i < maps; i++) {
+        QualityMap map;
+        if (!quality_generate(&job, i, &map)) continue;
+        quality_analyze(&map, &scratch);
+        if (quality_filter(&job, &map)) quality_save(&job, &map);
+    }
+    quality_scratch_free(&scratch);
+#endif
+
+    double seconds = elapsed_seconds(&start);
+    qsort(job.accepted, job.num_accepted, sizeof(uint64_t), compare_seeds);
+    for (long i = 0; i < job.num_accepted; i++) printf("%llu\n", (unsigned long long)job.accepted[i]);
+
+    long n = job.num_accepted, made = maps - atomic_load(&job.failed);
+    printf("=== Kwaliteit ===\n");
+    printf("Kaarten: %ld met %d kamers (%.0f kaarten/s)\n", maps, rooms, seconds > 0 ? maps / seconds : 0.0);
+    printf("Goedgekeurd: %ld (%.1f%%), afgekeurd op afstand: %ld, verhouding: %ld, overleven: %ld\n", 
+           n, made ? 100.0 * n / made : 0.0, job.rejected[0], job.rejected[1], job.rejected[2]);
+    if (atomic_load(&job.failed)) printf("Niet gemaakt: %ld\n", atomic_load(&job.failed));
+    if (job.save_errors) printf("Niet opgeslagen: %ld\n", job.save_errors);
+    if (n) {
+        printf("Goedgekeurd gemiddeld: afstand %.2f, overleven %.1f%%, schade %.1f HP, "
+               "items zonder gevecht %.1f, monsters/items %.2f\n", (double)job.sum.distance / n, 
+               100.0 * job.survival_sum / n, job.damage_sum / n, (double)job.sum.item_value / n, 
+               job.sum.items ? (double)job.sum.monsters / job.sum.items : 0.0);
+    }
+    for (int s = 0; s < NUM_STAGES; s++) 
+        printf("  %-10s %d threads, %.2f s bezig\n", stage_names[s], job.threads[s], job.busy[s]);
+    free(job.accepted);
+    return 0;
+}
+
+// Co-op
+// Several players, each on their own thread, play in one dungeon through
+// game_step, choosing as explore_action does. Every player has a view of the
+// dungeon: a copy of the Dungeon struct with its own player and generator,
+// sharing the rooms and doors. game_step and fight change a room only by a
+// compare-and-swap on its state (see Room state), so the players race for
+// the same monsters, items and treasure as they would in one game. Rooms that
+// were emptied fill up again now and then, so the races never die down.
+typedef struct {
+    _Alignas(64) Dungeon view; // Shared rooms, own player and generator
+    int turns;
+    Player start;      // Where the player starts again after dying or winning
+    uint8_t* visited;  // Rooms this player has been in
+    uint32_t* spawned; // Per room: refills by this player
+    long actions, treasures, deaths;
+} CoopPlayer;
+
+// Refills an emptied room with the odds populate_rooms uses, under a new
+// generation; the entrance and the treasure room stay as they are
+static void coop_respawn(CoopPlayer* p, Room* r) {
+    Dungeon* d = &p->view;
+    RoomState s = room_state(r);
+    if (r->id == 0 || state_type(s) == TREASURE || state_present(s)) return;
+    int roll = rng_below(&d->rng, 100);
+    RoomContent c = {EMPTY};
+    if (roll < 40) {
+        c.type = MONSTER;
+        c.content.monster = create_monster(d, rng_below(&d->rng, MAX_MONSTER_TYPES));
+    } else if (roll < 75) {
+        c.type = ITEM;
+        c.content.item = create_item(d);
+    } else {
+        return;
+    }
+    if (room_cas(d, r, &s, state_make(c, false, state_gen(s) + 1))) p->spawned[r->id]++;
+}
+
+// One game_step. Doors go to a room this player has not been in where there
+// is one, as explore_door would pick with the player's own visited rooms.
+static void coop_turn(CoopPlayer* p) {
+    Dungeon* d = &p->view;
+    Room* current = find_room_by_id(d, d->player.current_room_id);
+    int action = explore_action(NULL, d, current), target = -1;
+    p->actions++;
+    if (action == 6) return; // No doors: nothing left to do here
+    if (action == 1) {
+        int start = rng_below(&d->rng, current->num_doors);
+        target = current->doors[start];
+        for (int i = 0; i < current->num_doors; i++) {
+            int door = current->doors[(start + i) % current->num_doors];
+            if (!p->visited[door]) {
+                target = door;
+                break;
+            }
+        }
+        p->visited[target] = 1;
+        if (rng_below(&d->rng, 4) == 0) coop_respawn(p, find_room_by_id(d, target));
+    }
+    StepResult result = game_step(d, current, action, target);
+    // As in game_loop, a game also ends when the player is out of hp or has the treasure
+    if (result == STEP_DIED || d->player.hp <= 0) p->deaths++;
+    else if (d->player.has_treasure) p->treasures++;
+    else return;
+    d->player = p->start;
+}
+
+static void* coop_player(void* arg) {
+    CoopPlayer* p = arg;
+    for (int t = 0; t < p->turns; t++) coop_turn(p);
+    return NULL;
+}
+
+static bool coop_player_init(CoopPlayer* p, Dungeon* d, int turns, uint64_t seed) {
+    *p = (CoopPlayer){.view = *d, .turns = turns, .start = d->player};
+    p->view.out = NULL;
+    p->view.headless = true;
+    p->view.lost_races = 0;
+    rng_seed(&p->view.rng, seed);
+    p->visited = calloc(d->num_rooms, 1);
+    p->spawned = calloc(d->num_rooms, sizeof(uint32_t));
+    p->view.taken = calloc(d->num_rooms, sizeof(uint32_t));
+    if (p->visited) p->visited[d->player.current_room_id] = 1;
+    return p->visited && p->spawned && p->view.taken;
+}
+
+static void coop_player_free(CoopPlayer* p) {
+    free(p->visited);
+    free(p->spawned);
+    free(p->view.taken);
+}
+
+// Every content is used up once: what a room held at the start plus its
+// refills is what the players cleared plus what it holds now. A monster
+// killed twice or an item taken by two players breaks this.
+static long coop_check(Dungeon* d, const uint8_t* initial, CoopPlayer* players, int count) {
+    long bad = 0;
+    FOR_EACH_ROOM(d, r) {
+        long taken = 0, spawned = 0;
+        for (int i = 0; i < count; i++) {
+            taken += players[i].view.taken[r->id];
+            spawned += players[i].spawned[r->id];
+        }
+        if (initial[r->id] + spawned != taken + state_present(room_state(r))) bad++;
+    }
+    return bad;
+}
+
+// Plays turns actions per player in a fresh dungeon; the result is printed as
+// one line. False when a room was used up twice.
+static bool coop_round(int rooms, int count, int turns, uint64_t seed) {
+    Dungeon* d = generate_dungeon(rooms, seed);
+    uint8_t* initial = malloc(rooms);
+    CoopPlayer* players = aligned_alloc(64, count * sizeof(CoopPlayer));
+    if (!d || !initial || !players) {
+        if (d) free_dungeon(d);
+        free(initial);
+        free(players);
+        printf("Niet genoeg geheugen voor %d spelers\n", count);
+        return false;
+    }
+    populate_rooms(d);
+    FOR_EACH_ROOM(d, r) initial[r->id] = state_present(room_state(r));
+    int ready = 0;
+    while (ready < count && coop_player_init(&players[ready], d, turns, seed + 1 + ready)) ready++;
+    if (ready < count) coop_player_free(&players[ready]);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef HAVE_PTHREAD
+    // Player 0 is the calling thread
+    pthread_t* tids = calloc(ready, sizeof(pthread_t));
+    int started = ready ? 1 : 0;
+    while (tids && started < ready && pthread_create(&tids[started], NULL, coop_player, &players[started]) == 0)
+        started++;
+    if (ready) coop_player(&players[0]);
+    for (int i = 1; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+#else
+    // One thread: the players take turns
+    int started = ready;
+    for (int t = 0; t < turns; t++)
+        for (int i = 0; i < ready; i++) coop_turn(&players[i]);
+#endif
+    double seconds = elapsed_seconds(&start);
+
+    long actions = 0, cleared = 0, treasures = 0, deaths = 0, lost_races = 0;
+    for (int i = 0; i < started; i++) {
+        actions += players[i].actions;
+        for (int id = 0; id < rooms; id++) cleared += players[i].view.taken[id];
+        treasures += players[i].treasures;
+        deaths += players[i].deaths;
+        lost_races += players[i].view.lost_races;
+    }
+    long bad = coop_check(d, initial, players, started);
+    printf("%3d spelers: %9.0f acties/s, %ld kamers leeggemaakt, schat %ld keer, %ld keer dood, "
+           "%ld CAS verloren, %s\n", started, seconds > 0 ? actions / seconds : 0.0, cleared, treasures, 
+           deaths, lost_races, bad ? "DUBBEL GEBRUIKT" : "goed");
+    if (bad) printf("  %ld kamers kloppen niet\n", bad);
+    for (int i = 0; i < ready; i++) coop_player_free(&players[i]);
+    free(players);
+    free(initial);
+    free_dungeon(d);
+    return !bad && started == count;
+}
+
+// Stress test: players in one dungeon where emptied rooms fill up again,
+// for 1, 2, 4, ... up to players at a time, each taking turns actions
+int run_coop(int players, int rooms, int turns, uint64_t seed) {
+    printf("=== Co-op ===\nSeed %llu, %d kamers, %d beurten per speler\n",
+           (unsigned long long)seed, rooms, turns);
+    bool ok = true;
+    for (int count = 1;; count = count * 2 < players ? count * 2 : players) {
+        ok &= coop_round(rooms, count, turns, seed);
+        if (count == players) break;
+    }
+    return ok ? 0 : 1;
+}
+
+// Batch combat
+// fight_batch resolves many independent player-vs-monster fights at once,
+// with hp, damage and type in separate arrays. Each fight draws from its own
+// generator in exactly the order fight() does (special roll, then one attack
+// pattern per round), so its outcome matches a scalar fight() on the same
+// stream. Only the draws are scalar; the special actions and the four
+// pattern steps of a round are masked vector updates over FIGHT_LANES fights.
+// Build with -mavx2 (or -march=native) for 8 lanes, SSE2 gives 4.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FIGHT_LANES 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FIGHT_LANES 4
+#else
+#define FIGHT_LANES 1
+#endif
+
+static void fight_lanes_scalar(FightBatch* b, int start, int n) {
+    for (int k = start; k < start + n; k++) {
+        int32_t php = b->player_hp[k], mhp = b->monster_hp[k];
+        int32_t pd = b->player_damage[k], md = b->monster_damage[k];
+        Rng* rng = &b->rng[k];
+        bool won = true;
+        const MonsterInfo* info = &monster_info[b->monster_type[k]];
+        if (rng_below(rng, 4) == 0 && info->special) {
+            php -= info->special_damage;
+            mhp += info->special_heal;
+        }
+        while (php > 0 && mhp > 0) {
+            int pattern = rng_below(rng, 16);
+            for (int i = 3; i >= 0 && php > 0 && mhp > 0; i--) {
+                if ((pattern >> i) & 1) mhp -= pd;
+                else if ((php -= md) <= 0) won = false;
+            }
+        }
+        b->player_hp[k] = php;
+        b->monster_hp[k] = mhp;
+        b->won[k] = won;
+    }
+}
+
+#if FIGHT_LANES > 1
+// Rolls the special action of n fights from start, as fight() does
+static void special_lanes(FightBatch* b, int start, int n, int32_t* damage, int32_t* hp) {
+    for (int k = 0; k < n; k++) {
+        const MonsterInfo* info = &monster_info[b->monster_type[start + k]];
+        bool special = rng_below(&b->rng[start + k], 4) == 0 && info->special;
+        damage[k] = special ? info->special_damage : 0;
+        hp[k] = special ? info->special_heal : 0;
+    }
+}
+#endif
+
+#if FIGHT_LANES == 8
+static void fight_lanes_simd(FightBatch* b, int start) {
+    int32_t draw[8];
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1);
+    __m256i php = _mm256_loadu_si256((const __m256i*)(b->player_hp + start));
+    __m256i mhp = _mm256_loadu_si256((const __m256i*)(b->monster_hp + start));
+    __m256i pd = _mm256_loadu_si256((const __m256i*)(b->player_damage + start));
+    __m256i md = _mm256_loadu_si256((const __m256i*)(b->monster_damage + start));
+    __m256i lost = zero;
+
+    // 25% special: the type's extra damage and hp, gathered per lane
+    int32_t extra_damage[8], extra_hp[8];
+    special_lanes(b, start, 8, extra_damage, extra_hp);
+    php = _mm256_sub_epi32(php, _mm256_loadu_si256((const __m256i*)extra_damage));
+    mhp = _mm256_add_epi32(mhp, _mm256_loadu_si256((const __m256i*)extra_hp));
+
+    for (;;) {
+        __m256i alive = _mm256_and_si256(_mm256_cmpgt_epi32(php, zero), _mm256_cmpgt_epi32(mhp, zero));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(alive));
+        if (!mask) break;
+        for (int k = 0; k < 8; k++) 
+            if (mask >> k & 1) draw[k] = rng_below(&b->rng[start + k], 16);
+        __m256i pattern = _mm256_loadu_si256((const __m256i*)draw);
+
+        for (int i = 3; i >= 0; i--) {
+            __m256i player_turn = _mm256_cmpeq_epi32(
+                _mm256_and_si256(_mm256_srl_epi32(pattern, _mm_cvtsi32_si128(i)), one), one);
+            __m256i hits_monster = _mm256_and_si256(alive, player_turn);
+            __m256i hits_player = _mm256_andnot_si256(player_turn, alive);
+            mhp = _mm256_sub_epi32(mhp, _mm256_and_si256(hits_monster, pd));
+            php = _mm256_sub_epi32(php, _mm256_and_si256(hits_player, md));
+            lost = _mm256_or_si256(lost, _mm256_andnot_si256(_mm256_cmpgt_epi32(php, zero), hits_player));
+            alive = _mm256_and_si256(alive, _mm256_and_si256(_mm256_cmpgt_epi32(php, zero), 
+                                                            _mm256_cmpgt_epi32(mhp, zero)));
+        }
+    }
+
+    _mm256_storeu_si256((__m256i*)(b->player_hp + start), php);
+    _mm256_storeu_si256((__m256i*)(b->monster_hp + start), mhp);
+    int lost_mask = _mm256_movemask_ps(_mm256_castsi256_ps(lost));
+    for (int k = 0; k < 8; k++) b->won[start + k] = !(lost_mask >> k & 1);
+}
+#elif FIGHT_LANES == 4
+static void fight_lanes_simd(FightBatch* b, int start) {
+    int32_t draw[4];
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+    __m128i php = _mm_loadu_si128((const __m128i*)(b->player_hp + start));
+    __m128i mhp = _mm_loadu_si128((const __m128i*)(b->monster_hp + start));
+    __m128i pd = _mm_loadu_si128((const __m128i*)(b->player_damage + start));
+    __m128i md = _mm_loadu_si128((const __m128i*)(b->monster_damage + start));
+    __m128i lost = zero;
+
+    // 25% special: the type's extra damage and hp, gathered per lane
+    int32_t extra_damage[4], extra_hp[4];
+    special_lanes(b, start, 4, extra_damage, extra_hp);
+    php = _mm_sub_epi32(php, _mm_loadu_si128((const __m128i*)extra_damage));
+    mhp = _mm_add_epi32(mhp, _mm_loadu_si128((const __m128i*)extra_hp));
+
+    for (;;) {
+        __m128i alive = _mm_and_si128(_mm_cmpgt_epi32(php, zero), _mm_cmpgt_epi32(mhp, zero));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(alive));
+        if (!mask) break;
+        for (int k = 0; k < 4; k++) 
+            if (mask >> k & 1) draw[k] = rng_below(&b->rng[start + k], 16);
+        __m128i pattern = _mm_loadu_si128((const __m128i*)draw);
+
+        for (int i = 3; i >= 0; i--) {
+            __m128i player_turn = _mm_cmpeq_epi32(
+                _mm_and_si128(_mm_srl_epi32(pattern, _mm_cvtsi32_si128(i)), one), one);
+            __m128i hits_monster = _mm_and_si128(alive, player_turn);
+            __m128i hits_player = _mm_andnot_si128(player_turn, alive);
+            mhp = _mm_sub_epi32(mhp, _mm_and_si128(hits_monster, pd));
+            php = _mm_sub_epi32(php, _mm_and_si128(hits_player, md));
+            lost = _mm_or_si128(lost, _mm_andnot_si128(_mm_cmpgt_epi32(php, zero), hits_player));
+            alive = _mm_and_si128(alive, _mm_and_si128(_mm_cmpgt_epi32(php, zero), 
+                                                       _mm_cmpgt_epi32(mhp, zero)));
+        }
+    }
+
+    _mm_storeu_si128((__m128i*)(b->player_hp + start), php);
+    _mm_storeu_si128((__m128i*)(b->monster_hp + start), mhp);
+    int lost_mask = _mm_movemask_ps(_mm_castsi128_ps(lost));
+    for (int k = 0; k < 4; k++) b->won[start + k] = !(lost_mask >> k & 1);
+}
+#endif
+
+void fight_batch(FightBatch* b) {
+    int k = 0;
+    STAT_ADD(batch_fights, b->count);
+#if FIGHT_LANES > 1
+    for (; k + FIGHT_LANES <= b->count; k += FIGHT_LANES) fight_lanes_simd(b, k);
+#endif
+    fight_lanes_scalar(b, k, b->count - k);
+}
+
+// Rolls num_fights fights with create_monster and the generator's player
+// damage range, resolves them with fight_batch and with fight(), and checks
+// that hp and outcome agree for every fight. fight_odds must predict the
+// number of fights survived to within 4 standard deviations.
+int benchmark_fights(int num_fights, uint64_t seed) {
+    FightBatch b = {num_fights, malloc(num_fights * sizeof(int32_t)), 
+                    malloc(num_fights * sizeof(int32_t)), malloc(num_fights * sizeof(int32_t)), 
+                    malloc(num_fights * sizeof(int32_t)), malloc(num_fights), 
+                    malloc(num_fights * sizeof(Rng)), malloc(num_fights)};
+    int32_t* start_php = malloc(num_fights * sizeof(int32_t));
+    int32_t* start_mhp = malloc(num_fights * sizeof(int32_t));
+    bool ok = b.player_hp && b.player_damage && b.monster_hp && b.monster_damage && 
+              b.monster_type && b.rng && b.won && start_php && start_mhp;
+
+    // create_monster only needs the dungeon for its generator
+    Dungeon scratch = {0};
+    for (int i = 0; ok && i < num_fights; i++) {
+        rng_seed(&scratch.rng, seed + i);
+        Monster m = create_monster(&scratch, rng_below(&scratch.rng, MAX_MONSTER_TYPES));
+        start_php[i] = b.player_hp[i] = 100;
+        b.player_damage[i] = RAND_RANGE(&scratch.rng, 10, 20);
+        start_mhp[i] = b.monster_hp[i] = m.hp;
+        b.monster_damage[i] = m.damage;
+        b.monster_type[i] = m.type;
+        rng_seed(&b.rng[i], ~(seed + i));
+    }
+
+    long mismatches = 0, wins = 0;
+    double batch_seconds = 0, scalar_seconds = 0;
+    bool odds_ok = true;
+    if (ok) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fight_batch(&b);
+        batch_seconds = elapsed_seconds(&start);
+
+        // Same fights through the scalar fight(), each on a copy of its stream
+        Dungeon ref = {0};
+        ref.headless = true;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_fights; i++) {
+            ref.player = (Player){0, start_php[i], start_php[i], b.player_damage[i], false};
+            rng_seed(&ref.rng, ~(seed + i));
+            Room room = {0};
+            Monster m = {b.monster_type[i], start_mhp[i], b.monster_damage[i]};
+            room_set(&room, (RoomContent){MONSTER, {.monster = m}}, false);
+            bool won = fight(&ref, &room);
+            wins += won;
+            mismatches += won != b.won[i] || ref.player.hp != b.player_hp[i] || 
+                          state_hp(room_state(&room)) != b.monster_hp[i];
+        }
+        scalar_seconds = elapsed_seconds(&start);
+
+        // The same fights predicted, against the survivors and their hp
+        double expected = 0, variance = 0, expected_hp = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_fights; i++) {
+            Monster m = {b.monster_type[i], start_mhp[i], b.monster_damage[i]};
+            FightOdds odds = fight_odds(start_php[i], b.player_damage[i], &m);
+            expected += odds.win;
+            variance += odds.win * (1 - odds.win);
+            expected_hp += odds.win * odds.hp_left;
+        }
+        double odds_seconds = elapsed_seconds(&start);
+        long survived = 0, hp_total = 0;
+        for (int i = 0; i < num_fights; i++) {
+            if (!b.won[i] || b.player_hp[i] <= 0) continue;
+            survived++;
+            hp_total += b.player_hp[i];
+        }
+        odds_ok = (survived - expected) * (survived - expected) <= 16 * variance + 1e-6;
+
+        printf("Gevechten: %d, %d lanes\n", num_fights, FIGHT_LANES);
+        printf("Batch:  %.1f ns/gevecht\n", batch_seconds * 1e9 / num_fights);
+        printf("fight(): %.1f ns/gevecht\n", scalar_seconds * 1e9 / num_fights);
+        printf("fight_odds(): %.1f ns/gevecht\n", odds_seconds * 1e9 / num_fights);
+        printf("Gewonnen: %.2f%%, verschillen: %ld\n", 100.0 * wins / num_fights, mismatches);
+        printf("Overleefd: %.2f%%, voorspeld %.2f%%; HP daarna %.2f, voorspeld %.2f%s\n", 
+               100.0 * survived / num_fights, 100.0 * expected / num_fights, 
+               survived ? (double)hp_total / survived : 0.0, expected > 0 ? expected_hp / expected : 0.0, 
+               odds_ok ? "" : " (wijkt af)");
+    }
+
+    free(b.player_hp); free(b.player_damage); free(b.monster_hp); free(b.monster_damage);
+    free(b.monster_type); free(b.rng); free(b.won); free(start_php); free(start_mhp);
+    return ok && mismatches == 0 && odds_ok ? 0 : 1;
+}
+
+// Fight odds
+// Every bit of every attack pattern is a player hit or a monster hit with
+// chance 1/2, and fight() stops at the hit that kills, so a fight is a race
+// of fair coin flips and the rounds do not matter. With a the player hits
+// the monster can take and b the monster hits the player can take, the
+// player wins when their a-th hit comes before the monster's b-th:
+//   win(a, 0) = 0, win(0, b) = 1, win(a, b) = (win(a - 1, b) + win(a, b - 1)) / 2
+// hits(a, b), the expected monster hits taken in the fights that are won,
+// follows the same recurrence plus win(a, b - 1) for the hit itself. The odds
+// depend on (a, b) alone, so one table serves every hp and damage; both are
+// filled once up to FIGHT_ODDS_MAX, and larger pairs sum the same series
+// term by term, which is not constant time (see race_odds). The special
+// action makes it the mix of two such races.
+#define FIGHT_ODDS_MAX 64
+
+static double odds_win[FIGHT_ODDS_MAX + 1][FIGHT_ODDS_MAX + 1];
+static double odds_hits[FIGHT_ODDS_MAX + 1][FIGHT_ODDS_MAX + 1];
+
+static void build_odds(void) {
+    for (int a = 0; a <= FIGHT_ODDS_MAX; a++) {
+        for (int b = 1; b <= FIGHT_ODDS_MAX; b++) {
+            if (a == 0) {
+                odds_win[a][b] = 1;
+                continue;
+            }
+            odds_win[a][b] = (odds_win[a - 1][b] + odds_win[a][b - 1]) / 2;
+            odds_hits[a][b] = (odds_hits[a - 1][b] + odds_hits[a][b - 1] + odds_win[a][b - 1]) / 2;
+        }
+    }
+}
+
+static void race_odds(long a, long b, double* win, double* hits) {
+    if (a <= FIGHT_ODDS_MAX && b <= FIGHT_ODDS_MAX) {
+        *win = odds_win[a][b];
+        *hits = odds_hits[a][b];
+        return;
+    }
+    // Past the table this costs one term per monster hit, O(min(b, a + 40 sqrt(a)))
+    // with the cut-off below: about 2 ns a term, so a few microseconds for
+    // pairs in the thousands. Game monsters stay inside the table.
+    // The player wins after f < b monster hits with chance C(a - 1 + f, f) / 2^(a + f).
+    // The terms are summed times 2^shift, which starts at 2^a and is taken
+    // down whenever the sum gets large, so 2^-a cannot underflow to 0 first;
+    // the scale comes off at the end
+    double t = 1, w = 0, h = 0;
+    long shift = a;
+    for (long f = 0; f < b; f++) {
+        w += t;
+        h += f * t;
+        if (f > a && t < 1e-17 * w) break; // Past the peak, the rest no longer shows
+        t *= (double)(a + f) / (2.0 * (f + 1));
+        if (w > 0x1p512) {
+            t *= 0x1p-512; w *= 0x1p-512; h *= 0x1p-512;
+            shift -= 512;
+        }
+    }
+    for (; shift >= 64 && w > 0; shift -= 64) w *= 0x1p-64, h *= 0x1p-64;
+    for (; shift > 0 && w > 0; shift--) w /= 2, h /= 2;
+    *win = w;
+    *hits = h;
+}
+
+// Odds of the pattern rounds alone; a player at 0 hp has lost
+static void race(int hp, int damage, int monster_hp, int monster_damage, double* win, double* hp_left) {
+    *win = *hp_left = 0;
+    if (hp <= 0 || (damage <= 0 && monster_hp > 0)) return; // fight() never ends without damage
+    if (monster_hp <= 0 || monster_damage <= 0) {
+        *win = 1;
+        *hp_left = hp;
+        return;
+    }
+    double hits;
+    race_odds(((long)monster_hp + damage - 1) / damage, ((long)hp + monster_damage - 1) / monster_damage, 
+              win, &hits);
+    if (*win > 0) *hp_left = hp - monster_damage * hits / *win;
+}
+
+// Chance that fight() leaves the player alive against m, and the hp they
+// expect to keep; constant time after the first call while both sides take
+// at most FIGHT_ODDS_MAX hits, see race_odds beyond that
+FightOdds fight_odds(int hp, int damage, const Monster* m) {
+#ifdef HAVE_PTHREAD
+    static pthread_once_t built = PTHREAD_ONCE_INIT;
+    pthread_once(&built, build_odds);
+#else
+    static bool built;
+    if (!built) build_odds();
+    built = true;
+#endif
+    const MonsterInfo* info = &monster_info[m->type];
+    double win, hp_left, special_win, special_hp_left;
+    race(hp, damage, m->hp, m->damage, &win, &hp_left);
+    if (!info->special) return (FightOdds){win, hp_left};
+
+    // One fight in four starts with the special action
+    race(hp - info->special_damage, damage, m->hp + info->special_heal, m->damage, &special_win, &special_hp_left);
+    FightOdds odds = {0.75 * win + 0.25 * special_win, 0};
+    if (odds.win > 0) odds.hp_left = (0.75 * win * hp_left + 0.25 * special_win * special_hp_left) / odds.win;
+    return odds;
+}
+
+// Benchmark suite
+// Runs each operation over a sweep of room counts and writes one JSON object
+// per (operation, room count) to stdout: ns per operation, heap allocations
+// per operation and the process' peak RSS so far. The output is meant to be
+// diffed between versions.
+typedef struct {
+    const char* name;
+    int rooms;
+    long ops;
+    double seconds;
+    long allocs;
+    long file_bytes; // Size of the save written, 0 = not a save
+} BenchResult;
+
+static long peak_rss_kb(void) {
+#ifdef HAVE_MMAP
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) return ru.ru_maxrss;
+#endif
+    return 0;
+}
+
+static void print_bench_result(const BenchResult* r, bool* first) {
+    printf("%s\n    {\"name\": \"%s\", \"rooms\": %d, \"ops\": %ld, \"ns_per_op\": %.1f, "
+           "\"allocs_per_op\": %.2f, \"peak_rss_kb\": %ld", *first ? "" : ",", r->name, r->rooms, 
+           r->ops, r->ops ? r->seconds * 1e9 / r->ops : 0.0, r->ops ? (double)r->allocs / r->ops : 0.0, 
+           peak_rss_kb());
+    if (r->file_bytes) printf(", \"file_bytes\": %ld", r->file_bytes);
+    printf("}");
+    *first = false;
+}
+
+static long file_size(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return 0;
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : 0;
+    fclose(f);
+    return size;
+}
+
+#define BENCH_START(res, bench_name, n) \
+    BenchResult res = {bench_name, n, 0, 0, 0, 0}; \
+    long res##_allocs = atomic_load(&heap_allocs); \
+    struct timespec res##_start; \
+    clock_gettime(CLOCK_MONOTONIC, &res##_start)
+#define BENCH_STOP(res) \
+    res.seconds = elapsed_seconds(&res##_start); \
+    res.allocs = atomic_load(&heap_allocs) - res##_allocs
+
+static volatile long bench_sink;
+
+int benchmark_suite(int max_rooms, uint64_t seed) {
+    const char* file = "dungeon_bench.dat";
+    bool first = true;
+    printf("{\n  \"seed\": %llu,\n  \"fight_lanes\": %d,\n  \"arena\": %d,\n  \"results\": [", 
+           (unsigned long long)seed, FIGHT_LANES, DUNGEON_ARENA);
+
+    for (long n = 1000; n <= max_rooms; n *= 10) {
+        // Repeat small sizes so every measurement covers about 10^6 rooms
+        long reps = n < 1000000 ? 1000000 / n : 1;
+
+        BENCH_START(gen, "generate_dungeon", n);
+        for (long i = 0; i < reps; i++, gen.ops++) {
+            Dungeon* g = generate_dungeon(n, seed + i);
+            if (!g) break;
+            free_dungeon(g);
+        }
+        BENCH_STOP(gen);
+        print_bench_result(&gen, &first);
+
+        Dungeon* d = generate_dungeon(n, seed);
+        if (!d) break;
+        BENCH_START(pop, "populate_rooms", n);
+        for (long i = 0; i < reps; i++, pop.ops++) populate_rooms(d);
+        BENCH_STOP(pop);
+        print_bench_result(&pop, &first);
+
+        BENCH_START(save, "save_game", n);
+        for (long i = 0; i < reps; i++, save.ops++) save_game(d, file);
+        BENCH_STOP(save);
+        save.file_bytes = file_size(file);
+        print_bench_result(&save, &first);
+
+        BENCH_START(load, "load_game", n);
+        for (long i = 0; i < reps; i++, load.ops++) {
+            Dungeon* l = load_game(file);
+            if (l) free_dungeon(l);
+        }
+        BENCH_STOP(load);
+        print_bench_result(&load, &first);
+
+        // Mapped load plus a touch of every room, so the overlay cost is included
+        BENCH_START(mapped, "load_game_mapped", n);
+        for (long i = 0; i < reps; i++, mapped.ops++) {
+            Dungeon* l = load_game_mapped(file);
+            if (!l) continue;
+            FOR_EACH_ROOM(l, r) (void)r;
+            free_dungeon(l);
+        }
+        BENCH_STOP(mapped);
+        print_bench_result(&mapped, &first);
+
+        d->compact = true;
+        BENCH_START(csave, "save_game_compact", n);
+        for (long i = 0; i < reps; i++, csave.ops++) save_game(d, file);
+        BENCH_STOP(csave);
+        csave.file_bytes = file_size(file);
+        print_bench_result(&csave, &first);
+        d->compact = false;
+
+        BENCH_START(cload, "load_game_compact", n);
+        for (long i = 0; i < reps; i++, cload.ops++) {
+            Dungeon* l = load_game(file);
+            if (l) free_dungeon(l);
+        }
+        BENCH_STOP(cload);
+        print_bench_result(&cload, &first);
+
+        // Random walk through the doors, one find_room_by_id per step
+        Room* r = d->entrance;
+        long walked = 0;
+        BENCH_START(walk, "find_room_by_id_walk", n);
+        for (walk.ops = 0; walk.ops < 1000000; walk.ops++) {
+            int next = r->num_doors ? (int)r->doors[rng_below(&d->rng, r->num_doors)] 
+                                    : rng_below(&d->rng, d->num_rooms);
+            r = find_room_by_id(d, next);
+            walked += r->id;
+        }
+        BENCH_STOP(walk);
+        bench_sink = walked; // Keeps the walk from being optimised away
+        print_bench_result(&walk, &first);
+
+        // Headless fights against every monster of the dungeon, on fresh copies
+        Dungeon ref = {0};
+        ref.headless = true;
+        rng_seed(&ref.rng, seed);
+        BENCH_START(fights, "fight_headless", n);
+        while (fights.ops < 1000000) {
+            long before = fights.ops;
+            FOR_EACH_ROOM(d, room) {
+                if (room_type(room) != MONSTER) continue;
+                Room copy = {0};
+                atomic_init(&copy.state, room_state(room));
+                ref.player = (Player){0, 100, 100, d->player.damage, false};
+                fight(&ref, &copy);
+                fights.ops++;
+            }
+            if (fights.ops == before) break;
+        }
+        BENCH_STOP(fights);
+        print_bench_result(&fights, &first);
+        free_dungeon(d);
+    }
+
+    // Random walk through a lazily built dungeon of INT_MAX rooms, startup included
+    BENCH_START(lazy, "lazy_walk", INT_MAX);
+    Dungeon* l = generate_lazy_dungeon(INT_MAX, seed, 0);
+    for (Room* r = l ? l->entrance : NULL; r && lazy.ops < 1000000; lazy.ops++) {
+        l->player.current_room_id = r->id;
+        int next = r->num_doors ? (int)r->doors[rng_below(&l->rng, r->num_doors)] 
+                                : rng_below(&l->rng, l->num_rooms);
+        r = find_room_by_id(l, next);
+    }
+    BENCH_STOP(lazy);
+    print_bench_result(&lazy, &first);
+    if (l) free_dungeon(l);
+    remove(file);
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
+// Arena allocator
+// Blocks come from calloc, so arena memory is always zeroed. Nothing is
+// freed individually; the whole arena goes at once in arena_release.
+static ArenaBlock* arena_add_block(Arena* a, size_t size) {
+    ArenaBlock* b = counted_calloc(1, sizeof(ArenaBlock) + size);
+    if (!b) return NULL;
+    b->size = size;
+    b->next = a->head;
+    a->head = b;
+    return b;
+}
+
+bool arena_init(Arena* a, size_t size_hint) {
+    a->head = NULL;
+    a->block_size = size_hint < 4096 ? 4096 : size_hint;
+    return arena_add_block(a, a->block_size) != NULL;
+}
+
+void* arena_alloc(Arena* a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* b = a->head;
+    if (!b || b->size - b->used < size) {
+        // Later blocks double, so an arena that starts small still needs few of them
+        if (b) a->block_size *= 2;
+        b = arena_add_block(a, size > a->block_size ? size : a->block_size);
+        if (!b) return NULL;
+    }
+    void* p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void arena_release(Arena* a) {
+    while (a->head) {
+        ArenaBlock* next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+#if DUNGEON_ARENA
+// Upper bound for a dungeon's arena: the room table plus a full door row
+// for every room
+static size_t dungeon_arena_size(int num_rooms) {
+    return (size_t)num_rooms * (sizeof(Room) + 4 * sizeof(uint32_t)) + 2 * ARENA_ALIGN;
+}
+#endif
+
+void* dungeon_alloc(Dungeon* d, size_t size) {
+#if DUNGEON_ARENA
+    return arena_alloc(&d->arena, size);
+#else
+    (void)d;
+    return counted_calloc(1, size);
+#endif
+}
+
+// Dungeon generation and management
+Dungeon* create_dungeon(int num_rooms) {
+    Dungeon* d = counted_calloc(1, sizeof(Dungeon));
+    if (!d) return NULL;
+#if DUNGEON_ARENA
+    if (!arena_init(&d->arena, dungeon_arena_size(num_rooms))) {
+        free(d);
+        return NULL;
+    }
+#else
+    d->arena = (Arena){NULL, 0};
+#endif
+    d->rooms = dungeon_alloc(d, (size_t)num_rooms * sizeof(Room));
+    if (!d->rooms) {
+        arena_release(&d->arena);
+        free(d);
+        return NULL;
+    }
+    d->num_rooms = num_rooms;
+    d->entrance = NULL;
+    d->map = NULL;
+    rng_seed(&d->rng, 0); // Reseeded by generate_dungeon or the caller of load_game
+    return d;
+}
+
+// Door rows are handed out by assign_door_rows once every room has its max_doors
+Room* create_room(Dungeon* d, int id, int max_doors) {
+    Room* r = &d->rooms[id];
+    *r = (Room){.id = id, .max_doors = max_doors}; // State 0: empty, not cleared
+    return r;
+}
+
+// Lays the door rows of all rooms out back to back in one table (CSR with
+// max_doors slots per row), so a room's doors sit next to its neighbours'
+bool assign_door_rows(Dungeon* d) {
+    size_t slots = 0;
+    for (int i = 0; i < d->num_rooms; i++) slots += d->rooms[i].max_doors;
+    d->doors = dungeon_alloc(d, (slots ? slots : 1) * sizeof(uint32_t));
+    if (!d->doors) return false;
+    slots = 0;
+    for (int i = 0; i < d->num_rooms; i++) {
+        d->rooms[i].doors = d->doors + slots;
+        slots += d->rooms[i].max_doors;
+    }
+    return true;
+}
+
+// Only the ranges of the chosen type are rolled: hp, then damage
+Monster create_monster(Dungeon* d, MonsterType type) {
+    const MonsterInfo* info = &monster_info[type];
+    int hp = RAND_RANGE(&d->rng, info->min_hp, info->max_hp);
+    int damage = RAND_RANGE(&d->rng, info->min_damage, info->max_damage);
+    return (Monster){type, hp, damage};
+}
+
+Item create_item(Dungeon* d) {
+    ItemType type = rng_below(&d->rng, MAX_ITEM_TYPES);
+    return (Item){type, RAND_RANGE(&d->rng, item_info[type].min_value, item_info[type].max_value)};
+}
+
+bool connect_rooms(Dungeon* d, Room* a, Room* b) {
+    if (a->num_doors >= a->max_doors || b->num_doors >= b->max_doors) return false;
+    a->doors[a->num_doors++] = b->id;
+    b->doors[b->num_doors++] = a->id;
+    if (d->graph) graph_door_added(d, a->id, b->id);
+    return true;
+}
+
+bool rooms_connected(Room* a, Room* b) {
+    for (int i = 0; i < a->num_doors; i++) {
+        STAT_ADD(rooms_connected_probes, 1);
+        if ((int)a->doors[i] == b->id) return true;
+    }
+    return false;
+}
+
+// Probes are counted where they happen: one for the room table, one per
+// slot tried in the lazy index or the overlay of a mapped save
+Room* find_room_by_id(Dungeon* d, int id) {
+    STAT_ADD(find_room_calls, 1);
+    if (id < 0 || id >= d->num_rooms) return NULL;
+    if (d->rooms) {
+        STAT_ADD(find_room_probes, 1);
+        return &d->rooms[id];
+    }
+    if (d->lazy) return lazy_room(d, id);
+    return mapped_room(d, id);
+}
+
+// Original extra-door pass: one attempt per free slot, with up to 100 random
+// draws to find a room that is not r or already connected to it. The
+// connection is silently dropped when the drawn room has no free slot left.
+void add_extra_doors_legacy(Dungeon* d) {
+    FOR_EACH_ROOM(d, r) {
+        for (int j = r->num_doors; j < r->max_doors; j++) {
+            int target, attempts = 0;
+            do { 
+                target = rng_below(&d->rng, d->num_rooms); 
+                STAT_ADD(door_draws, 1);
+            } while ((target == r->id || rooms_connected(r, find_room_by_id(d, target))) && ++attempts < 100);
+            STAT_ADD(door_rejections, attempts);
+            
+            if (attempts < 100) {
+                connect_rooms(d, r, find_room_by_id(d, target));
+            }
+        }
+    }
+}
+
+// Extra-door pass with the same per-slot semantics as the legacy pass, but
+// the target is drawn directly from the rooms that are neither r nor already
+// connected to it: the draw is an index into that set, and is mapped to a room
+// id by stepping over the sorted ids of r and its (at most 4) neighbours. No
+// draw is ever rejected, and a full target still costs the slot. Rooms and
+// targets are limited to ids in [lo, hi).
+static void add_extra_doors_range(Dungeon* d, Rng* rng, int lo, int hi) {
+    for (int id = lo; id < hi; id++) {
+        Room* r = find_room_by_id(d, id);
+        for (int j = r->num_doors; j < r->max_doors; j++) {
+            int skip[5], n = 0;
+            skip[n++] = r->id - lo;
+            for (int i = 0; i < r->num_doors; i++) {
+                int other = (int)r->doors[i] - lo, k = n++;
+                if (other < 0 || other >= hi - lo) {
+                    n--;
+                    continue;
+                }
+                for (; k > 0 && skip[k - 1] > other; k--) skip[k] = skip[k - 1];
+                skip[k] = other;
+            }
+            if (hi - lo <= n) break;
+
+            int target = rng_below(rng, hi - lo - n);
+            STAT_ADD(door_draws, 1);
+            for (int k = 0; k < n && skip[k] <= target; k++) target++;
+            connect_rooms(d, r, find_room_by_id(d, lo + target));
+        }
+    }
+}
+
+void add_extra_doors(Dungeon* d) {
+    add_extra_doors_range(d, &d->rng, 0, d->num_rooms);
+}
+
+// Rooms, player and spanning tree, followed by the given extra-door pass
+Dungeon* generate_layout(int num_rooms, uint64_t seed, void (*extra_doors)(Dungeon* d)) {
+    STAT_BEGIN(generate);
+    Dungeon* d = create_dungeon(num_rooms);
+    if (!d) {
+        STAT_END(generate);
+        return NULL;
+    }
+    rng_seed(&d->rng, seed);
+    
+    // Create all rooms in the room table
+    for (int i = 0; i < num_rooms; i++)
+        create_room(d, i, RAND_RANGE(&d->rng, 1, 4));
+    if (!assign_door_rows(d)) {
+        free_dungeon(d);
+        STAT_END(generate);
+        return NULL;
+    }
+    
+    d->entrance = find_room_by_id(d, 0);
+    d->player = (Player){0, 100, 100, RAND_RANGE(&d->rng, 10, 20), false}; // current_room_id initialized to 0
+    
+    // Connect rooms in a tree structure
+    for (int i = 1; i < num_rooms; i++) {
+        Room* new_room = find_room_by_id(d, i);
+        Room* existing_room = find_room_by_id(d, rng_below(&d->rng, i));
+        connect_rooms(d, existing_room, new_room);
+    }
+    
+    // Add extra random connections
+    extra_doors(d);
+    STAT_END(generate);
+    return d;
+}
+
+Dungeon* generate_dungeon(int num_rooms, uint64_t seed) {
+    return generate_layout(num_rooms, seed, add_extra_doors);
+}
+
+// Times both extra-door passes and the parallel generator at 10^3 rooms
+// and up, compares the resulting door counts, and times populate_rooms
+// against populate_rooms_parallel on the parallel layout
+int benchmark_generation(int max_rooms, uint64_t seed, int threads) {
+    struct { const char* name; void (*extra_doors)(Dungeon* d); } algos[] = {
+        {"legacy", add_extra_doors_legacy}, {"direct", add_extra_doors}, {"par", NULL}
+    };
+    printf("%10s %-7s %10s %9s %8s %7s  %s\n", "kamers", "algo", "ms", "ns/kamer", 
+           "deuren", "vol%", "kamers met 0/1/2/3/4 deuren (%)");
+    for (long n = 1000; n <= max_rooms; n *= 10) {
+        for (int a = 0; a < 3; a++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            Dungeon* d = algos[a].extra_doors ? generate_layout(n, seed, algos[a].extra_doors) 
+                                              : generate_dungeon_parallel(n, seed, threads);
+            double seconds = elapsed_seconds(&start);
+            if (!d) {
+                printf("Niet genoeg geheugen voor %ld kamers\n", n);
+                return 1;
+            }
+
+            long degree[5] = {0}, doors = 0, full = 0;
+            FOR_EACH_ROOM(d, r) {
+                degree[r->num_doors]++;
+                doors += r->num_doors;
+                full += r->num_doors == r->max_doors;
+            }
+            printf("%10ld %-7s %10.1f %9.1f %8.3f %7.1f ", n, algos[a].name, seconds * 1e3, 
+                   seconds * 1e9 / n, (double)doors / n, 100.0 * full / n);
+            for (int k = 0; k < 5; k++) printf(" %4.1f", 100.0 * degree[k] / n);
+            printf("\n");
+            if (!algos[a].extra_doors) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                populate_rooms(d);
+                double seq = elapsed_seconds(&start);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                populate_rooms_parallel(d, threads);
+                printf("%10ld populate %.1f ms, parallel %.1f ms\n", n, seq * 1e3, elapsed_seconds(&start) * 1e3);
+            }
+            free_dungeon(d);
+        }
+    }
+    return 0;
+}
+
+void populate_rooms(Dungeon* d) {
+    STAT_BEGIN(populate);
+    FOR_EACH_ROOM(d, r) room_set(r, (RoomContent){EMPTY}, false);
+
+    int treasure = 1 + rng_below(&d->rng, d->num_rooms - 1);
+    room_set(find_room_by_id(d, treasure), (RoomContent){TREASURE}, false);
+    
+    int monster;
+    do { 
+        monster = 1 + rng_below(&d->rng, d->num_rooms - 1); 
+        STAT_ADD(populate_attempts, 1);
+    } while (monster == treasure);
+    RoomContent c = {MONSTER, {.monster = create_monster(d, rng_below(&d->rng, MAX_MONSTER_TYPES))}};
+    room_set(find_room_by_id(d, monster), c, false);
+
+    FOR_EACH_ROOM(d, room) {
+        if (room->id == 0 || room->id == treasure || room->id == monster) continue;
+        
+        int r = rng_below(&d->rng, 100);
+        if (r < 40) {
+            c = (RoomContent){MONSTER, {.monster = create_monster(d, rng_below(&d->rng, MAX_MONSTER_TYPES))}};
+            room_set(room, c, false);
+        } else if (r < 75) {
+            room_set(room, (RoomContent){ITEM, {.item = create_item(d)}}, false);
+        }
+    }
+    STAT_END(populate);
+}
+
+// Parallel generation
+// The room ids are split into one contiguous range per thread, and every
+// range draws from its own generator seeded from the dungeon's, so the
+// result depends on the seed and the thread count but not on scheduling.
+// A thread only writes rooms of its own range:
+//   1. every range rolls its rooms' max_doors and counts its door slots
+//   2. every range points its rooms at their rows of the door table
+//   3. the calling thread connects the first room of every range to a
+//      random room of the ranges before it, or the next one after that with
+//      a free slot, which stitches the ranges together
+//   4. every range builds its spanning tree and extra doors within itself
+// With one thread this is generate_layout with the range rng in place of
+// the dungeon's. Room 0 stays the entrance.
+typedef struct {
+    Dungeon* d;
+    int lo, hi, phase;
+    Rng rng;
+    size_t slots; // Door slots of the range, then its first slot in the table
+    int treasure, monster; // Population: rooms populate_rooms places first
+} GenPart;
+
+static void* gen_part(void* arg) {
+    GenPart* p = arg;
+    Dungeon* d = p->d;
+    if (p->phase == 1) {
+        p->slots = 0;
+        for (int i = p->lo; i < p->hi; i++) 
+            p->slots += create_room(d, i, RAND_RANGE(&p->rng, 1, 4))->max_doors;
+    } else if (p->phase == 2) {
+        for (int i = p->lo; i < p->hi; i++) {
+            d->rooms[i].doors = d->doors + p->slots;
+            p->slots += d->rooms[i].max_doors;
+        }
+    } else if (p->phase == 3) {
+        for (int i = p->lo + 1; i < p->hi; i++) 
+            connect_rooms(d, &d->rooms[p->lo + rng_below(&p->rng, i - p->lo)], &d->rooms[i]);
+        add_extra_doors_range(d, &p->rng, p->lo, p->hi);
+    } else {
+        // create_monster and create_item draw from a dungeon's generator
+        Dungeon local = {0};
+        local.rng = p->rng;
+        for (int i = p->lo; i < p->hi; i++) {
+            Room* room = &d->rooms[i];
+            if (i == 0 || i == p->treasure || i == p->monster) continue;
+            int r = rng_below(&local.rng, 100);
+            RoomContent c = {EMPTY};
+            if (r < 40) {
+                c.type = MONSTER;
+                c.content.monster = create_monster(&local, rng_below(&local.rng, MAX_MONSTER_TYPES));
+            } else if (r < 75) {
+                c.type = ITEM;
+                c.content.item = create_item(&local);
+            }
+            room_set(room, c, false);
+        }
+        p->rng = local.rng;
+    }
+    return NULL;
+}
+
+// Runs one phase on every range, part 0 on the calling thread
+static void run_gen_phase(GenPart* parts, int count, int phase) {
+    for (int i = 0; i < count; i++) parts[i].phase = phase;
+#ifdef HAVE_PTHREAD
+    // Ranges whose thread did not start run here afterwards
+    pthread_t* tids = calloc(count, sizeof(pthread_t));
+    bool* started = calloc(count, sizeof(bool));
+    for (int i = 1; tids && started && i < count; i++) 
+        started[i] = pthread_create(&tids[i], NULL, gen_part, &parts[i]) == 0;
+    gen_part(&parts[0]);
+    for (int i = 1; i < count; i++) {
+        if (started && started[i]) pthread_join(tids[i], NULL);
+        else gen_part(&parts[i]);
+    }
+    free(tids);
+    free(started);
+#else
+    for (int i = 0; i < count; i++) gen_part(&parts[i]);
+#endif
+}
+
+// Ranges of at least 1024 rooms; threads <= 0 uses one per online CPU
+static GenPart* gen_parts(Dungeon* d, int* threads) {
+#ifdef HAVE_PTHREAD
+    if (*threads <= 0) *threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (*threads > d->num_rooms / 1024) *threads = d->num_rooms / 1024;
+    if (*threads < 1) *threads = 1;
+    GenPart* parts = counted_calloc(*threads, sizeof(GenPart));
+    if (!parts) return NULL;
+    for (int i = 0; i < *threads; i++) {
+        parts[i] = (GenPart){.d = d, .lo = (int)((int64_t)d->num_rooms * i / *threads), 
+                             .hi = (int)((int64_t)d->num_rooms * (i + 1) / *threads)};
+        rng_seed(&parts[i].rng, rng_next(&d->rng));
+    }
+    return parts;
+}
+
+Dungeon* generate_dungeon_parallel(int num_rooms, uint64_t seed, int threads) {
+    STAT_BEGIN(generate);
+    Dungeon* d = create_dungeon(num_rooms);
+    if (!d) {
+        STAT_END(generate);
+        return NULL;
+    }
+    rng_seed(&d->rng, seed);
+    GenPart* parts = gen_parts(d, &threads);
+    if (!parts) {
+        free_dungeon(d);
+        STAT_END(generate);
+        return NULL;
+    }
+
+    run_gen_phase(parts, threads, 1);
+    size_t slots = 0;
+    for (int i = 0; i < threads; i++) {
+        size_t n = parts[i].slots;
+        parts[i].slots = slots;
+        slots += n;
+    }
+    d->doors = dungeon_alloc(d, slots * sizeof(uint32_t));
+    if (!d->doors) {
+        free(parts);
+        free_dungeon(d);
+        STAT_END(generate);
+        return NULL;
+    }
+    run_gen_phase(parts, threads, 2);
+
+    d->entrance = find_room_by_id(d, 0);
+    d->player = (Player){0, 100, 100, RAND_RANGE(&d->rng, 10, 20), false};
+    for (int i = 1; i < threads; i++) {
+        // Earlier ranges hold over 1024 slots for at most threads - 2 stitches
+        int k = rng_below(&d->rng, parts[i].lo);
+        while (d->rooms[k].num_doors == d->rooms[k].max_doors) k = (k + 1) % parts[i].lo;
+        bool stitched = connect_rooms(d, &d->rooms[k], &d->rooms[parts[i].lo]);
+        assert(stitched);
+        (void)stitched;
+    }
+    run_gen_phase(parts, threads, 3);
+    free(parts);
+    STAT_END(generate);
+    return d;
+}
+
+// populate_rooms over the same ranges: the treasure and the guaranteed
+// monster come from the dungeon's generator, everything else from the ranges'
+void populate_rooms_parallel(Dungeon* d, int threads) {
+    GenPart* parts = d->rooms ? gen_parts(d, &threads) : NULL;
+    if (!parts) {
+        populate_rooms(d);
+        return;
+    }
+    STAT_BEGIN(populate);
+    int treasure = 1 + rng_below(&d->rng, d->num_rooms - 1), monster;
+    do { 
+        monster = 1 + rng_below(&d->rng, d->num_rooms - 1); 
+        STAT_ADD(populate_attempts, 1);
+    } while (monster == treasure);
+    room_set(&d->rooms[treasure], (RoomContent){TREASURE}, false);
+    RoomContent c = {MONSTER, {.monster = create_monster(d, rng_below(&d->rng, MAX_MONSTER_TYPES))}};
+    room_set(&d->rooms[monster], c, false);
+    room_set(&d->rooms[0], (RoomContent){EMPTY}, false);
+    for (int i = 0; i < threads; i++) {
+        parts[i].treasure = treasure;
+        parts[i].monster = monster;
+    }
+    run_gen_phase(parts, threads, 4);
+    free(parts);
+    STAT_END(populate);
+}
+
+// Graph analytics
+// Doors are two-way, so the room graph is undirected. dungeon_graph builds
+// the caches the first time one is needed; from then on connect_rooms keeps
+// them current. A new door can only shorten distances and merge components,
+// so the entrance BFS is repaired from the door outwards and the union-find
+// merges two sets. Articulation points can disappear anywhere on a cycle
+// the door closes, so they are recomputed on the next query instead.
+static void free_graph(RoomGraph* g) {
+    free(g->dist); free(g->parent); free(g->uf); free(g->uf_size); 
+    free(g->articulation); free(g->queue); free(g);
+}
+
+static int graph_find(RoomGraph* g, int id) {
+    while (g->uf[id] != id) id = g->uf[id] = g->uf[g->uf[id]];
+    return id;
+}
+
+static void graph_union(RoomGraph* g, int a, int b) {
+    a = graph_find(g, a);
+    b = graph_find(g, b);
+    if (a == b) return;
+    if (g->uf_size[a] < g->uf_size[b]) { int t = a; a = b; b = t; }
+    g->uf[b] = a;
+    g->uf_size[a] += g->uf_size[b];
+    g->components--;
+}
+
+// Breadth-first from the rooms already in queue[0..tail), which must have
+// their dist set; only lowers distances, so it also repairs after a new door
+static void graph_relax(Dungeon* d, RoomGraph* g, int tail) {
+    for (int head = 0; head < tail; head++) {
+        Room* r = find_room_by_id(d, g->queue[head]);
+        for (int i = 0; i < r->num_doors; i++) {
+            int next = r->doors[i];
+            if (g->dist[next] >= 0 && g->dist[next] <= g->dist[r->id] + 1) continue;
+            g->dist[next] = g->dist[r->id] + 1;
+            g->parent[next] = r->id;
+            g->queue[tail++] = next;
+        }
+    }
+}
+
+void graph_door_added(Dungeon* d, int a, int b) {
+    RoomGraph* g = d->graph;
+    graph_union(g, a, b);
+    g->articulation_valid = false;
+    if (g->dist[b] >= 0 && (g->dist[a] < 0 || g->dist[b] + 1 < g->dist[a])) {
+        int t = a; a = b; b = t;
+    }
+    if (g->dist[a] >= 0 && (g->dist[b] < 0 || g->dist[a] + 1 < g->dist[b])) {
+        g->dist[b] = g->dist[a] + 1;
+        g->parent[b] = a;
+        g->queue[0] = b;
+        graph_relax(d, g, 1);
+    }
+}
+
+RoomGraph* dungeon_graph(Dungeon* d) {
+    if (d->graph) return d->graph;
+    STAT_BEGIN(graph);
+    int n = d->num_rooms;
+    RoomGraph* g = counted_calloc(1, sizeof(RoomGraph));
+    if (!g) {
+        STAT_END(graph);
+        return NULL;
+    }
+    g->dist = counted_malloc(n * sizeof(int32_t));
+    g->parent = counted_malloc(n * sizeof(int32_t));
+    g->uf = counted_malloc(n * sizeof(int32_t));
+    g->uf_size = counted_malloc(n * sizeof(int32_t));
+    g->articulation = counted_calloc(n, 1);
+    g->queue = counted_malloc(n * sizeof(int32_t));
+    d->graph = g;
+    if (!g->dist || !g->parent || !g->uf || !g->uf_size || !g->articulation || !g->queue) {
+        free_graph(g);
+        STAT_END(graph);
+        return d->graph = NULL;
+    }
+
+    g->components = n;
+    g->treasure = -1;
+    for (int i = 0; i < n; i++) {
+        g->dist[i] = g->parent[i] = -1;
+        g->uf[i] = i;
+        g->uf_size[i] = 1;
+    }
+    FOR_EACH_ROOM(d, r) 
+        for (int i = 0; i < r->num_doors; i++) graph_union(g, r->id, r->doors[i]);
+
+    int entrance = d->entrance ? d->entrance->id : 0;
+    g->dist[entrance] = 0;
+    g->queue[0] = entrance;
+    graph_relax(d, g, 1);
+    STAT_END(graph);
+    return g;
+}
+
+// Doors from the entrance to room id, -1 when it cannot be reached
+int graph_distance(Dungeon* d, int id) {
+    RoomGraph* g = dungeon_graph(d);
+    if (!g || id < 0 || id >= d->num_rooms) return -1;
+    return g->dist[id];
+}
+
+// Fills path with a shortest route from the entrance to the treasure room
+// (both included) and returns its length in rooms, or -1 when there is no
+// reachable treasure or the path is longer than max rooms
+int graph_treasure_path(Dungeon* d, int* path, int max) {
+    RoomGraph* g = dungeon_graph(d);
+    if (!g) return -1;
+    Room* t = g->treasure >= 0 ? find_room_by_id(d, g->treasure) : NULL;
+    if (!t || room_type(t) != TREASURE) {
+        // populate_rooms moves the treasure without touching the doors
+        g->treasure = -1;
+        FOR_EACH_ROOM(d, r) 
+            if (room_type(r) == TREASURE) { g->treasure = r->id; break; }
+        if (g->treasure < 0) return -1;
+    }
+    int len = g->dist[g->treasure] + 1;
+    if (len <= 0 || len > max) return -1;
+    for (int i = len - 1, id = g->treasure; i >= 0; i--, id = g->parent[id]) path[i] = id;
+    return len;
+}
+
+// Representative room of id's component; equal for rooms that reach each other
+int graph_component(Dungeon* d, int id) {
+    RoomGraph* g = dungeon_graph(d);
+    if (!g || id < 0 || id >= d->num_rooms) return -1;
+    return graph_find(g, id);
+}
+
+// Iterative Tarjan over all components, low-link via the door index stack
+static bool graph_articulation(Dungeon* d, RoomGraph* g) {
+    int n = d->num_rooms;
+    int32_t* disc = counted_malloc(n * sizeof(int32_t));
+    int32_t* low = counted_malloc(n * sizeof(int32_t));
+    uint8_t* next_door = counted_calloc(n, 1);
+    if (!disc || !low || !next_door) {
+        free(disc); free(low); free(next_door);
+        return false;
+    }
+    memset(g->articulation, 0, n);
+    for (int i = 0; i < n; i++) disc[i] = -1;
+
+    int time = 0;
+    int32_t* stack = g->queue; // Holds the DFS path; parent is the entry below
+    for (int root = 0; root < n; root++) {
+        if (disc[root] >= 0) continue;
+        int top = 0, root_children = 0;
+        stack[top++] = root;
+        disc[root] = low[root] = time++;
+        while (top > 0) {
+            Room* r = find_room_by_id(d, stack[top - 1]);
+            int parent = top > 1 ? stack[top - 2] : -1;
+            if (next_door[r->id] < r->num_doors) {
+                int next = r->doors[next_door[r->id]++];
+                if (next == parent) continue;
+                if (disc[next] >= 0) {
+                    if (disc[next] < low[r->id]) low[r->id] = disc[next];
+                    continue;
+                }
+                disc[next] = low[next] = time++;
+                stack[top++] = next;
+                if (parent < 0) root_children++;
+            } else {
+                top--;
+                if (parent < 0) continue;
+                if (low[r->id] < low[parent]) low[parent] = low[r->id];
+                if (parent != root && low[r->id] >= disc[parent]) g->articulation[parent] = 1;
+            }
+        }
+        g->articulation[root] = root_children > 1;
+    }
+    free(disc); free(low); free(next_door);
+    g->articulation_valid = true;
+    return true;
+}
+
+bool graph_is_articulation(Dungeon* d, int id) {
+    RoomGraph* g = dungeon_graph(d);
+    if (!g || id < 0 || id >= d->num_rooms) return false;
+    if (!g->articulation_valid && !graph_articulation(d, g)) return false;
+    return g->articulation[id];
+}
+
+// Distances from count sources at once into out[k * num_rooms + room], -1
+// when unreachable. Sources go in groups of 64 that share one BFS: every room
+// keeps a 64-bit mask of the sources that have reached it, and each level
+// moves the frontier masks through the doors, so one pass advances all 64
+// searches by a step. Small frontiers push their masks to the neighbours;
+// once the frontier covers a sizeable part of the dungeon, every room pulls
+// from its neighbours instead, which walks the door table in order.
+bool graph_distances(Dungeon* d, const int* sources, int count, int32_t* out) {
+    int n = d->num_rooms;
+    uint64_t* seen = counted_calloc(n, sizeof(uint64_t));
+    uint64_t* frontier = counted_calloc(n, sizeof(uint64_t));
+    uint64_t* next = counted_calloc(n, sizeof(uint64_t));
+    int32_t* current = counted_malloc(n * sizeof(int32_t));
+    int32_t* touched = counted_malloc(n * sizeof(int32_t));
+    if (!seen || !frontier || !next || !current || !touched) {
+        free(seen); free(frontier); free(next); free(current); free(touched);
+        return false;
+    }
+    for (size_t i = 0; i < (size_t)count * n; i++) out[i] = -1;
+
+    for (int base = 0; base < count; base += 64) {
+        int lanes = count - base < 64 ? count - base : 64, size = 0;
+        memset(seen, 0, n * sizeof(uint64_t));
+        for (int k = 0; k < lanes; k++) {
+            int src = sources[base + k];
+            if (src < 0 || src >= n) continue;
+            if (!frontier[src]) current[size++] = src;
+            seen[src] |= 1ull << k;
+            frontier[src] |= 1ull << k;
+            out[(size_t)(base + k) * n + src] = 0;
+        }
+        for (int level = 1; size > 0; level++) {
+            int reached = 0;
+            if (size > n / 16) {
+                FOR_EACH_ROOM(d, r) {
+                    uint64_t reach = 0;
+                    for (int j = 0; j < r->num_doors; j++) reach |= frontier[r->doors[j]];
+                    if (!(reach & ~seen[r->id])) continue;
+                    touched[reached++] = r->id;
+                    next[r->id] = reach;
+                }
+            } else {
+                for (int i = 0; i < size; i++) {
+                    Room* r = find_room_by_id(d, current[i]);
+                    for (int j = 0; j < r->num_doors; j++) {
+                        int v = r->doors[j];
+                        if (!next[v]) touched[reached++] = v;
+                        next[v] |= frontier[r->id];
+                    }
+                }
+            }
+            for (int i = 0; i < size; i++) frontier[current[i]] = 0;
+
+            // Keep the rooms that some search sees for the first time
+            size = 0;
+            for (int i = 0; i < reached; i++) {
+                int v = touched[i];
+                uint64_t bits = next[v] & ~seen[v];
+                next[v] = 0;
+                if (!bits) continue;
+                seen[v] |= bits;
+                frontier[v] = bits;
+                current[size++] = v;
+                for (; bits; bits &= bits - 1) 
+                    out[(size_t)(base + __builtin_ctzll(bits)) * n + v] = level;
+            }
+        }
+    }
+    free(seen); free(frontier); free(next); free(current); free(touched);
+    return true;
+}
+
+// Reports the analytics of one dungeon, then checks the incremental caches
+// against a rebuild after extra doors and the 64-source BFS against one BFS
+// per source
+int benchmark_graph(int num_rooms, uint64_t seed) {
+    Dungeon* d = generate_dungeon(num_rooms, seed);
+    if (!d) {
+        printf("Niet genoeg geheugen voor %d kamers\n", num_rooms);
+        return 1;
+    }
+    populate_rooms(d);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    RoomGraph* g = dungeon_graph(d);
+    double build_seconds = elapsed_seconds(&start);
+    if (!g) {
+        free_dungeon(d);
+        return 1;
+    }
+    int articulations = 0, reachable = 0, path[32];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FOR_EACH_ROOM(d, r) articulations += graph_is_articulation(d, r->id);
+    double articulation_seconds = elapsed_seconds(&start);
+    FOR_EACH_ROOM(d, r) reachable += graph_distance(d, r->id) >= 0;
+    int len = graph_treasure_path(d, path, 32);
+
+    printf("Kamers: %d, componenten: %d, bereikbaar vanaf ingang: %d\n", 
+           num_rooms, g->components, reachable);
+    printf("Scharnierkamers: %d\n", articulations);
+    if (g->treasure >= 0) printf("Schat in kamer %d, afstand %d", g->treasure, g->dist[g->treasure]);
+    if (len > 0) {
+        printf(": ");
+        for (int i = 0; i < len; i++) printf("%d%s", path[i], i < len - 1 ? " -> " : "");
+    }
+    printf("\n");
+    printf("Opbouw: %.2f ms, scharnierpunten: %.2f ms\n", build_seconds * 1e3, articulation_seconds * 1e3);
+
+    // New doors between random rooms with a free slot, then compare the
+    // repaired caches with a graph built from scratch
+    long mismatches = 0, added = 0;
+    for (int i = 0; i < num_rooms; i++) {
+        Room* a = find_room_by_id(d, rng_below(&d->rng, num_rooms));
+        Room* b = find_room_by_id(d, rng_below(&d->rng, num_rooms));
+        if (a != b && !rooms_connected(a, b)) added += connect_rooms(d, a, b);
+    }
+    d->graph = NULL;
+    RoomGraph* fresh = dungeon_graph(d);
+    int32_t* root_map = counted_malloc(num_rooms * sizeof(int32_t));
+    if (!fresh || !root_map) {
+        free(root_map);
+        free_graph(g);
+        free_dungeon(d);
+        return 1;
+    }
+    for (int i = 0; i < num_rooms; i++) root_map[i] = -1;
+    mismatches += fresh->components != g->components;
+    for (int i = 0; i < num_rooms; i++) {
+        int root = graph_find(g, i);
+        if (root_map[root] < 0) root_map[root] = graph_find(fresh, i);
+        mismatches += fresh->dist[i] != g->dist[i] || root_map[root] != graph_find(fresh, i);
+    }
+    free(root_map);
+    free_graph(g);
+    printf("Extra deuren: %ld, componenten: %d, verschillen na bijwerken: %ld\n", 
+           added, fresh->components, mismatches);
+
+    // Distances from up to 256 random sources: one bit-parallel pass per 64
+    // against a plain BFS per source
+    int count = num_rooms < 256 ? num_rooms : 256;
+    int* sources = counted_malloc(count * sizeof(int));
+    int32_t* out = counted_malloc((size_t)count * num_rooms * sizeof(int32_t));
+    int32_t* dist = counted_malloc(num_rooms * sizeof(int32_t));
+    if (!sources || !out || !dist) {
+        free(sources); free(out); free(dist);
+        free_dungeon(d);
+        return 1;
+    }
+    for (int k = 0; k < count; k++) sources[k] = rng_below(&d->rng, num_rooms);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = graph_distances(d, sources, count, out);
+    double parallel_seconds = elapsed_seconds(&start);
+
+    long bfs_mismatches = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int k = 0; ok && k < count; k++) {
+        int tail = 1;
+        for (int i = 0; i < num_rooms; i++) dist[i] = -1;
+        dist[sources[k]] = 0;
+        fresh->queue[0] = sources[k];
+        for (int head = 0; head < tail; head++) {
+            Room* r = find_room_by_id(d, fresh->queue[head]);
+            for (int i = 0; i < r->num_doors; i++) {
+                if (dist[r->doors[i]] >= 0) continue;
+                dist[r->doors[i]] = dist[r->id] + 1;
+                fresh->queue[tail++] = r->doors[i];
+            }
+        }
+        for (int i = 0; i < num_rooms; i++) bfs_mismatches += dist[i] != out[(size_t)k * num_rooms + i];
+    }
+    double plain_seconds = elapsed_seconds(&start);
+    printf("Afstanden vanaf %d kamers: bitparallel %.2f ms, los %.2f ms, verschillen: %ld\n", 
+           count, parallel_seconds * 1e3, plain_seconds * 1e3, bfs_mismatches);
+
+    free(sources); free(out); free(dist);
+    free_dungeon(d);
+    return ok && mismatches == 0 && bfs_mismatches == 0 ? 0 : 1;
+}
+
+// Save format (version 2), all fields little-endian:
+//   header:  magic "DNGS", u32 version, u32 num_rooms, u32 num_doors,
+//            i32 current_room_id, i32 hp, i32 max_hp, i32 damage,
+//            u8 has_treasure, 3 bytes padding
+//   rooms:   num_rooms records of SAVE_ROOM_SIZE bytes, in id order
+//            u32 first_door, u8 num_doors, u8 max_doors, u8 flags,
+//            u8 content type, u32 monster/item type, i32 hp/value, i32 damage
+//   doors:   num_doors u32 room ids; room i owns [first_door, first_door + num_doors)
+// Files without the magic are read as the original field-by-field format.
+#define SAVE_MAGIC "DNGS"
+#define SAVE_VERSION 2
+#define SAVE_HEADER_SIZE 36
+#define SAVE_ROOM_SIZE 20
+#define SAVE_CHUNK 4096 // Records per bulk read/write
+#define ROOM_VISITED 1
+#define ROOM_CLEARED 2
+
+static void put_u32(unsigned char* p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Player fields as in the header, 17 bytes from p
+static void put_player(unsigned char* p, const Player* pl) {
+    put_u32(p, pl->current_room_id);
+    put_u32(p + 4, pl->hp);
+    put_u32(p + 8, pl->max_hp);
+    put_u32(p + 12, pl->damage);
+    p[16] = pl->has_treasure;
+}
+
+static Player get_player(const unsigned char* p) {
+    return (Player){(int32_t)get_u32(p), (int32_t)get_u32(p + 4), (int32_t)get_u32(p + 8), 
+                    (int32_t)get_u32(p + 12), p[16] != 0};
+}
+
+// Flags and content of a room record (bytes 6 to 19), the part play changes
+static void put_room_state(unsigned char* p, const Room* r) {
+    RoomState s = room_state(r);
+    RoomContent c = state_content(s);
+    memset(p + 6, 0, SAVE_ROOM_SIZE - 6);
+    p[6] = (r->visited ? ROOM_VISITED : 0) | (state_cleared(s) ? ROOM_CLEARED : 0);
+    p[7] = c.type;
+    if (c.type == MONSTER) {
+        put_u32(p + 8, c.content.monster.type);
+        put_u32(p + 12, c.content.monster.hp);
+        put_u32(p + 16, c.content.monster.damage);
+    } else if (c.type == ITEM) {
+        put_u32(p + 8, c.content.item.type);
+        put_u32(p + 12, c.content.item.value);
+    }
+}
+
+// Content of a validated room record
+static RoomContent restore_content(const unsigned char* p) {
+    RoomContent c = {.type = p[7]};
+    if (c.type == MONSTER) 
+        c.content.monster = (Monster){get_u32(p + 8), (int32_t)get_u32(p + 12), (int32_t)get_u32(p + 16)};
+    else if (c.type == ITEM) 
+        c.content.item = (Item){get_u32(p + 8), (int32_t)get_u32(p + 12)};
+    return c;
+}
+
+static bool valid_room_state(const unsigned char* p) {
+    ContentType type = p[7];
+    uint32_t sub = get_u32(p + 8);
+    int32_t a = get_u32(p + 12), b = get_u32(p + 16);
+    return type <= TREASURE && (type != MONSTER || (sub < MAX_MONSTER_TYPES && state_fits(a) && state_fits(b))) && 
+           (type != ITEM || (sub < MAX_ITEM_TYPES && state_fits(a)));
+}
+
+static bool valid_room_record(const unsigned char* p, uint32_t first_door) {
+    return get_u32(p) == first_door && p[5] >= 1 && p[4] <= p[5] && valid_room_state(p);
+}
+
+// Memory-mapped saves
+// load_game_mapped maps a version 2 save read-only and leaves the room records
+// where they are. A room is copied into the arena the first time
+// find_room_by_id touches it, with its door list pointing straight into the
+// mapped door block. Everything the game changes (cleared, monster hp, picked
+// up items) lives in those copies, so the mapping itself is never written.
+static uint32_t overlay_slot(SaveMapping* m, uint32_t id) {
+    return (id * 2654435761u) & (m->overlay_cap - 1);
+}
+
+static Room* overlay_lookup(SaveMapping* m, int id) {
+    for (uint32_t i = overlay_slot(m, id);; i = (i + 1) & (m->overlay_cap - 1)) {
+        STAT_ADD(find_room_probes, 1);
+        if (!m->overlay[i] || m->overlay[i]->id == id) return m->overlay[i];
+    }
+}
+
+static bool overlay_insert(SaveMapping* m, Room* r) {
+    if ((m->overlay_count + 1) * 4 > m->overlay_cap * 3) {
+        Room** old = m->overlay;
+        uint32_t old_cap = m->overlay_cap;
+        Room** slots = counted_calloc(old_cap * 2, sizeof(Room*));
+        if (!slots) return false;
+        m->overlay = slots;
+        m->overlay_cap = old_cap * 2;
+        m->overlay_count = 0;
+        for (uint32_t i = 0; i < old_cap; i++) 
+            if (old[i]) overlay_insert(m, old[i]);
+        free(old);
+    }
+    uint32_t i = overlay_slot(m, r->id);
+    while (m->overlay[i]) i = (i + 1) & (m->overlay_cap - 1);
+    m->overlay[i] = r;
+    m->overlay_count++;
+    return true;
+}
+
+// Room as its record in the mapping describes it; records were validated
+// when the file was mapped
+static Room mapped_record(SaveMapping* m, int id) {
+    const unsigned char* p = m->records + (size_t)id * SAVE_ROOM_SIZE;
+    return (Room){.id = id, .num_doors = p[4], .max_doors = p[5], .visited = p[6] & ROOM_VISITED, 
+                  .doors = m->doors + get_u32(p), .state = state_make(restore_content(p), p[6] & ROOM_CLEARED, 0)};
+}
+
+Room* mapped_room(Dungeon* d, int id) {
+    SaveMapping* m = d->map;
+    Room* r = overlay_lookup(m, id);
+    if (r) return r;
+    r = dungeon_alloc(d, sizeof(Room));
+    if (!r) return NULL;
+    *r = mapped_record(m, id);
+    return overlay_insert(m, r) ? r : NULL;
+}
+
+Dungeon* load_game_mapped(const char* filename) {
+#ifdef HAVE_MMAP
+    // The door block is used in place as host u32s
+    const uint16_t probe = 1;
+    if (*(const unsigned char*)&probe != 1) return load_game(filename);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= SAVE_HEADER_SIZE) 
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return load_game(filename);
+
+    // Old saves and anything with a bad header take the regular path
+    const unsigned char* h = base;
+    uint64_t num_rooms = get_u32(h + 8), num_doors = get_u32(h + 12);
+    if (memcmp(h, SAVE_MAGIC, 4) != 0 || get_u32(h + 4) != SAVE_VERSION || 
+        num_rooms < 1 || num_rooms > INT_MAX || 
+        SAVE_HEADER_SIZE + num_rooms * SAVE_ROOM_SIZE + num_doors * 4 > (uint64_t)st.st_size) {
+        munmap(base, st.st_size);
+        return load_game(filename);
+    }
+
+    // One sequential sweep over records and door ids, without copying anything
+    STAT_BEGIN(load);
+    STAT_ADD(load_bytes_mapped, st.st_size);
+    const unsigned char* records = h + SAVE_HEADER_SIZE;
+    uint32_t* doors = (uint32_t*)(records + num_rooms * SAVE_ROOM_SIZE);
+    uint32_t first_door = 0;
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < num_rooms; i++) {
+        ok = valid_room_record(records + i * SAVE_ROOM_SIZE, first_door);
+        first_door += records[i * SAVE_ROOM_SIZE + 4];
+    }
+    ok = ok && first_door == num_doors;
+    for (uint64_t i = 0; ok && i < num_doors; i++) ok = doors[i] < num_rooms;
+
+    Dungeon* d = ok ? counted_calloc(1, sizeof(Dungeon)) : NULL;
+    SaveMapping* m = d ? counted_calloc(1, sizeof(SaveMapping)) : NULL;
+    if (m) {
+        m->overlay_cap = 1024;
+        m->overlay = counted_calloc(m->overlay_cap, sizeof(Room*));
+    }
+    if (!m || !m->overlay || !arena_init(&d->arena, 0)) {
+        if (m) free(m->overlay);
+        free(m);
+        free(d);
+        munmap(base, st.st_size);
+        STAT_END(load);
+        return NULL;
+    }
+    m->base = base;
+    m->size = st.st_size;
+    m->records = records;
+    m->doors = doors;
+    d->map = m;
+    d->rooms = NULL;
+    d->num_rooms = num_rooms;
+    rng_seed(&d->rng, 0);
+    d->player = get_player(h + 16);
+    d->entrance = find_room_by_id(d, 0);
+    if (!journal_replay(d, filename) || !find_room_by_id(d, d->player.current_room_id)) {
+        free_dungeon(d);
+        d = NULL;
+    }
+    STAT_END(load);
+    return d;
+#else
+    return load_game(filename);
+#endif
+}
+
+// Lazy dungeons
+// generate_lazy_dungeon creates no rooms up front. A room is built the first
+// time find_room_by_id asks for it, from hashes of (seed, id) alone:
+// - its parent is one of the LAZY_WINDOW rooms before it, so the rooms form
+//   one tree and a room finds its children among the LAZY_WINDOW after it
+// - ids are paired within blocks of 64 by XOR with a per-block mask, and half
+//   of those pairs get an extra door; both rooms of a pair derive the same one
+// - content is rolled as in populate_rooms, from the room's own stream
+// Built rooms live in a fixed number of slots; when they are full, the least
+// recently used room is dropped, except for the entrance and the player's
+// room. A dropped room that play has changed keeps its flags and content in
+// the saved-state table and gets them back when it is rebuilt. A Room* stays
+// valid while fewer than LAZY_MIN_RESIDENT other rooms are looked up.
+#define LAZY_WINDOW 8
+#define LAZY_MAX_DOORS (LAZY_WINDOW + 2)
+#define LAZY_RESIDENT 4096 // Default number of slots
+#define LAZY_MIN_RESIDENT 16
+
+static uint64_t lazy_hash(uint64_t seed, uint64_t id, uint64_t salt) {
+    uint64_t x = seed ^ id * 0xD6E8FEB86659FD93ull ^ salt * 0xA0761D6478BD642Full;
+    return splitmix64(&x);
+}
+
+static int lazy_parent(Dungeon* d, int id) {
+    int window = id < LAZY_WINDOW ? id : LAZY_WINDOW;
+    return id - 1 - (int)(lazy_hash(d->lazy->seed, id, 1) % window);
+}
+
+static int lazy_partner(Dungeon* d, int id) {
+    int other = id ^ (int)(1 + lazy_hash(d->lazy->seed, id >> 6, 2) % 63);
+    if (other >= d->num_rooms || lazy_hash(d->lazy->seed, id < other ? id : other, 3) & 1) return -1;
+    return other;
+}
+
+// Content as populate_rooms rolls it, on a stream of its own
+static RoomContent lazy_content(Dungeon* d, int id) {
+    if (id == 0) return (RoomContent){.type = EMPTY};
+    if (id == d->lazy->treasure) return (RoomContent){.type = TREASURE};
+    Rng saved = d->rng;
+    RoomContent c = {EMPTY};
+    rng_seed(&d->rng, lazy_hash(d->lazy->seed, id, 4));
+    int r = rng_below(&d->rng, 100);
+    if (r < 40) {
+        c.type = MONSTER;
+        c.content.monster = create_monster(d, rng_below(&d->rng, MAX_MONSTER_TYPES));
+    } else if (r < 75) {
+        c.type = ITEM;
+        c.content.item = create_item(d);
+    }
+    d->rng = saved;
+    return c;
+}
+
+static uint32_t lazy_bucket(uint32_t id, uint32_t mask) {
+    return (id * 2654435761u) & mask;
+}
+
+// Slot holding room id, or -1
+static int lazy_find(LazyDungeon* l, int id) {
+    for (uint32_t i = lazy_bucket(id, l->index_mask);; i = (i + 1) & l->index_mask) {
+        STAT_ADD(find_room_probes, 1);
+        if (l->index[i] < 0 || l->slots[l->index[i]].room.id == id) return l->index[i];
+    }
+}
+
+// Linear probing removal: later entries of the same run move up into the gap
+static void lazy_unindex(LazyDungeon* l, int id) {
+    uint32_t i = lazy_bucket(id, l->index_mask);
+    while (l->slots[l->index[i]].room.id != id) i = (i + 1) & l->index_mask;
+    for (uint32_t j = (i + 1) & l->index_mask; l->index[j] >= 0; j = (j + 1) & l->index_mask) {
+        uint32_t k = lazy_bucket(l->slots[l->index[j]].room.id, l->index_mask);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        l->index[i] = l->index[j];
+        i = j;
+    }
+    l->index[i] = -1;
+}
+
+static void lazy_unlink(LazyDungeon* l, int s) {
+    LazySlot* slot = &l->slots[s];
+    if (slot->prev >= 0) l->slots[slot->prev].next = slot->next; else l->head = slot->next;
+    if (slot->next >= 0) l->slots[slot->next].prev = slot->prev; else l->tail = slot->prev;
+}
+
+static void lazy_push_front(LazyDungeon* l, int s) {
+    l->slots[s].prev = -1;
+    l->slots[s].next = l->head;
+    if (l->head >= 0) l->slots[l->head].prev = s; else l->tail = s;
+    l->head = s;
+}
+
+// Entry for id in the saved-state table, added when missing
+static LazyState* lazy_state(LazyDungeon* l, int id, bool add) {
+    if (add && (l->saved_count + 1) * 4 > l->saved_cap * 3) {
+        LazyState* old = l->saved;
+        uint32_t old_cap = l->saved_cap;
+        LazyState* table = counted_calloc(old_cap * 2, sizeof(LazyState));
+        if (!table) return NULL;
+        l->saved = table;
+        l->saved_cap = old_cap * 2;
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (!old[i].key) continue;
+            uint32_t k = lazy_bucket(old[i].key - 1, l->saved_cap - 1);
+            while (table[k].key) k = (k + 1) & (l->saved_cap - 1);
+            table[k] = old[i];
+        }
+        free(old);
+    }
+    uint32_t i = lazy_bucket(id, l->saved_cap - 1);
+    while (l->saved[i].key && l->saved[i].key != (uint32_t)id + 1) i = (i + 1) & (l->saved_cap - 1);
+    if (!l->saved[i].key) {
+        if (!add) return NULL;
+        l->saved[i].key = id + 1;
+        l->saved_count++;
+    }
+    return &l->saved[i];
+}
+
+// True when play changed r, so dropping it must keep its state
+static bool lazy_changed(Dungeon* d, Room* r) {
+    if (r->visited || room_cleared(r) || lazy_state(d->lazy, r->id, false)) return true;
+    Room fresh = {.id = r->id, .state = state_make(lazy_content(d, r->id), false, 0)};
+    unsigned char a[SAVE_ROOM_SIZE], b[SAVE_ROOM_SIZE];
+    put_room_state(a, r);
+    put_room_state(b, &fresh);
+    return memcmp(a + 6, b + 6, SAVE_ROOM_SIZE - 6) != 0;
+}
+
+static void lazy_build(Dungeon* d, LazySlot* slot, int id) {
+    Room* r = &slot->room;
+    *r = (Room){.id = id, .doors = slot->doors, .state = state_make(lazy_content(d, id), false, 0)};
+    if (id > 0) r->doors[r->num_doors++] = lazy_parent(d, id);
+    int last = id < d->num_rooms - LAZY_WINDOW ? id + LAZY_WINDOW : d->num_rooms - 1; // No overflow at INT_MAX rooms
+    for (int j = id + 1; j <= last; j++) 
+        if (lazy_parent(d, j) == id) r->doors[r->num_doors++] = j;
+    int partner = lazy_partner(d, id);
+    if (partner >= 0 && !rooms_connected(r, &(Room){.id = partner})) 
+        r->doors[r->num_doors++] = partner;
+    r->max_doors = r->num_doors;
+
+    LazyState* s = lazy_state(d->lazy, id, false);
+    if (s) {
+        r->visited = s->state[0] & ROOM_VISITED;
+        unsigned char rec[SAVE_ROOM_SIZE];
+        memcpy(rec + 6, s->state, sizeof(s->state));
+        room_set(r, restore_content(rec), s->state[0] & ROOM_CLEARED);
+    }
+}
+
+Room* lazy_room(Dungeon* d, int id) {
+    LazyDungeon* l = d->lazy;
+    int s = lazy_find(l, id);
+    bool hit = s >= 0;
+    if (hit) {
+        lazy_unlink(l, s);
+    } else if (l->used < l->capacity) {
+        s = l->used++;
+    } else {
+        // Least recently used room other than the entrance and the player's room
+        for (s = l->tail; l->slots[s].room.id == 0 || l->slots[s].room.id == d->player.current_room_id; 
+             s = l->tail) {
+            lazy_unlink(l, s);
+            lazy_push_front(l, s);
+        }
+        Room* old = &l->slots[s].room;
+        if (lazy_changed(d, old)) {
+            LazyState* state = lazy_state(l, old->id, true);
+            if (!state) return NULL;
+            unsigned char rec[SAVE_ROOM_SIZE];
+            put_room_state(rec, old);
+            memcpy(state->state, rec + 6, sizeof(state->state));
+        }
+        lazy_unindex(l, old->id);
+        lazy_unlink(l, s);
+    }
+    if (!hit) {
+        lazy_build(d, &l->slots[s], id);
+        uint32_t i = lazy_bucket(id, l->index_mask);
+        while (l->index[i] >= 0) i = (i + 1) & l->index_mask;
+        l->index[i] = s;
+    }
+    lazy_push_front(l, s);
+    return &l->slots[s].room;
+}
+
+// Dungeon of num_rooms rooms of which at most resident (0 = LAZY_RESIDENT)
+// are built at a time. Costs the same whatever num_rooms is.
+Dungeon* generate_lazy_dungeon(int num_rooms, uint64_t seed, int resident) {
+    Dungeon* d = counted_calloc(1, sizeof(Dungeon));
+    LazyDungeon* l = d ? counted_calloc(1, sizeof(LazyDungeon)) : NULL;
+    if (!l) {
+        free(d);
+        return NULL;
+    }
+    d->lazy = l;
+    if (resident <= 0) resident = LAZY_RESIDENT;
+    l->capacity = resident < LAZY_MIN_RESIDENT ? LAZY_MIN_RESIDENT : resident;
+    for (l->index_mask = 1; l->index_mask < (uint32_t)l->capacity * 2; l->index_mask *= 2);
+    l->slots = counted_calloc(l->capacity, sizeof(LazySlot));
+    l->index = counted_malloc(l->index_mask * sizeof(int32_t));
+    l->saved_cap = 1024;
+    l->saved = counted_calloc(l->saved_cap, sizeof(LazyState));
+    if (!l->slots || !l->index || !l->saved) {
+        free_dungeon(d);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < l->index_mask; i++) l->index[i] = -1;
+    l->index_mask--;
+    l->head = l->tail = -1;
+    l->seed = seed;
+    l->treasure = 1 + lazy_hash(seed, 0, 5) % (num_rooms - 1);
+
+    d->num_rooms = num_rooms;
+    rng_seed(&d->rng, seed);
+    d->player = (Player){0, 100, 100, 10 + (int)(lazy_hash(seed, 0, 6) % 11), false};
+    d->entrance = find_room_by_id(d, 0);
+    return d;
+}
+
+// Lazy save: the 36-byte header of version 2 with magic "DNGL", the number
+// of records in place of num_doors and the seed appended as u64. Only rooms
+// play has changed are stored, each as u32 id plus bytes 6 to 19 of its room
+// record; every other room is rebuilt from the seed.
+#define LAZY_MAGIC "DNGL"
+#define LAZY_RECORD_SIZE 18
+
+static bool save_lazy(Dungeon* d, FILE* f) {
+    LazyDungeon* l = d->lazy;
+    unsigned char header[SAVE_HEADER_SIZE + 8] = {0}, rec[SAVE_ROOM_SIZE];
+    uint32_t count = 0;
+    for (int s = 0; s < l->used; s++) count += lazy_changed(d, &l->slots[s].room);
+    for (uint32_t i = 0; i < l->saved_cap; i++) 
+        count += l->saved[i].key && lazy_find(l, l->saved[i].key - 1) < 0;
+
+    memcpy(header, LAZY_MAGIC, 4);
+    put_u32(header + 4, SAVE_VERSION);
+    put_u32(header + 8, d->num_rooms);
+    put_u32(header + 12, count);
+    put_player(header + 16, &d->player);
+    put_u32(header + 36, (uint32_t)l->seed);
+    put_u32(header + 40, (uint32_t)(l->seed >> 32));
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+
+    // Built rooms first, then saved states of rooms that are not built
+    for (int s = 0; ok && s < l->used; s++) {
+        Room* r = &l->slots[s].room;
+        if (!lazy_changed(d, r)) continue;
+        put_room_state(rec, r);
+        put_u32(rec + 2, r->id);
+        ok = fwrite(rec + 2, LAZY_RECORD_SIZE, 1, f) == 1;
+    }
+    for (uint32_t i = 0; ok && i < l->saved_cap; i++) {
+        if (!l->saved[i].key || lazy_find(l, l->saved[i].key - 1) >= 0) continue;
+        put_u32(rec + 2, l->saved[i].key - 1);
+        memcpy(rec + 6, l->saved[i].state, sizeof(l->saved[i].state));
+        ok = fwrite(rec + 2, LAZY_RECORD_SIZE, 1, f) == 1;
+    }
+    return ok;
+}
+
+static Dungeon* load_lazy(FILE* f, const unsigned char* header) {
+    unsigned char seed[8], rec[SAVE_ROOM_SIZE];
+    uint32_t num_rooms = get_u32(header + 8), count = get_u32(header + 12);
+    if (get_u32(header + 4) != SAVE_VERSION || num_rooms < 3 || num_rooms > INT_MAX || 
+        fread(seed, 8, 1, f) != 1) 
+        return NULL;
+    Dungeon* d = generate_lazy_dungeon(num_rooms, get_u32(seed) | (uint64_t)get_u32(seed + 4) << 32, 0);
+    if (!d) return NULL;
+    d->player = get_player(header + 16);
+
+    // Records go to the saved-state table and apply when a room is built
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        ok = fread(rec + 2, LAZY_RECORD_SIZE, 1, f) == 1 && get_u32(rec + 2) < num_rooms && 
+             valid_room_state(rec);
+        LazyState* s = ok ? lazy_state(d->lazy, get_u32(rec + 2), true) : NULL;
+        if (s) memcpy(s->state, rec + 6, sizeof(s->state));
+        ok = s != NULL;
+    }
+    // Room 0 was built before its record was known
+    int entrance = lazy_find(d->lazy, 0);
+    if (ok && entrance >= 0) lazy_build(d, &d->lazy->slots[entrance], 0);
+    if (!ok) {
+        free_dungeon(d);
+        return NULL;
+    }
+    return d;
+}
+
+// Header of a version 2 save, also used by compact saves
+static bool write_save_header(Dungeon* d, FILE* f, const char* magic, uint32_t version) {
+    // Doors never change after generation, so a mapped save keeps its count
+    uint32_t num_doors = 0;
+    if (d->map) num_doors = get_u32((const unsigned char*)d->map->base + 12);
+    else FOR_EACH_ROOM(d, r) num_doors += r->num_doors;
+
+    unsigned char header[SAVE_HEADER_SIZE] = {0};
+    memcpy(header, magic, 4);
+    put_u32(header + 4, version);
+    put_u32(header + 8, d->num_rooms);
+    put_u32(header + 12, num_doors);
+    put_player(header + 16, &d->player);
+    return fwrite(header, SAVE_HEADER_SIZE, 1, f) == 1;
+}
+
+// Room records and door block of a save in the current format
+static bool save_rooms(Dungeon* d, FILE* f) {
+    unsigned char* buf = counted_malloc(SAVE_CHUNK * SAVE_ROOM_SIZE);
+    if (!buf) return false;
+    bool ok = write_save_header(d, f, SAVE_MAGIC, SAVE_VERSION);
+
+    // Room records, SAVE_CHUNK at a time
+    uint32_t first_door = 0;
+    int n = 0;
+    for (int i = 0; i < d->num_rooms; i++) {
+        unsigned char* p = buf + n * SAVE_ROOM_SIZE;
+        Room* r = d->map ? overlay_lookup(d->map, i) : &d->rooms[i];
+        if (!r) {
+            // Untouched room of a mapped save: its record is still current
+            memcpy(p, d->map->records + (size_t)i * SAVE_ROOM_SIZE, SAVE_ROOM_SIZE);
+            first_door += p[4];
+            if (++n == SAVE_CHUNK) {
+                ok = ok && fwrite(buf, SAVE_ROOM_SIZE, n, f) == (size_t)n;
+                n = 0;
+            }
+            continue;
+        }
+        put_u32(p, first_door);
+        p[4] = r->num_doors;
+        p[5] = r->max_doors;
+        put_room_state(p, r);
+        first_door += r->num_doors;
+        if (++n == SAVE_CHUNK) {
+            ok = ok && fwrite(buf, SAVE_ROOM_SIZE, n, f) == (size_t)n;
+            n = 0;
+        }
+    }
+    ok = ok && fwrite(buf, SAVE_ROOM_SIZE, n, f) == (size_t)n;
+
+    // Flat door id block, reusing the same buffer
+    int per_chunk = SAVE_CHUNK * SAVE_ROOM_SIZE / 4;
+    n = 0;
+    if (d->map) {
+        uint32_t num_doors = get_u32((const unsigned char*)d->map->base + 12);
+        ok = ok && fwrite(d->map->doors, 4, num_doors, f) == num_doors;
+    }
+    else FOR_EACH_ROOM(d, r) {
+        for (int j = 0; j < r->num_doors; j++) {
+            put_u32(buf + 4 * n, r->doors[j]);
+            if (++n == per_chunk) {
+                ok = ok && fwrite(buf, 4, n, f) == (size_t)n;
+                n = 0;
+            }
+        }
+    }
+    ok = ok && fwrite(buf, 4, n, f) == (size_t)n;
+
+    free(buf);
+    return ok;
+}
+
+// Compact saves
+// With -z, save_game writes the rooms as a byte stream instead of fixed
+// records and compresses it in blocks. Loading one keeps the dungeon compact,
+// so later saves stay in this format. load_game_mapped cannot map it and
+// falls back to load_game.
+//   header:  the 36 bytes of version 2 with magic "DNGC" and COMPACT_VERSION
+//   blocks:  u32 stream bytes, u32 packed bytes (top bit set: stored as is),
+//            then the packed bytes; every block holds at most COMPACT_BLOCK
+//            stream bytes
+// The stream has one entry per room, in id order, then the doors:
+//   room:    u8 visited | cleared << 1 | content type << 2 | min(num_doors, 7) << 4
+//            | (max_doors > num_doors) << 7, then varint num_doors if that was 7,
+//            varint max_doors - num_doors if bit 7 is set,
+//            monster: varint type, zigzag hp, zigzag damage; item: varint type, zigzag value
+//   doors:   per room in id order, zigzag of door id - room id
+// Varints hold 7 bits per byte, low bits first; zigzag maps 0, -1, 1, -2, ...
+// to 0, 1, 2, 3, ... so small negative numbers stay short too.
+#define COMPACT_MAGIC "DNGC"
+#define COMPACT_VERSION 1
+#define COMPACT_BLOCK 65536
+#define COMPACT_STORED 0x80000000u
+#define LZ_HASH_BITS 14
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16) // Packed size of n bytes that do not compress
+#define COMPACT_MEMORY ((sizeof(uint32_t) << LZ_HASH_BITS) + COMPACT_BLOCK + LZ_BOUND(COMPACT_BLOCK))
+
+// LZ77 in the style of LZ4. Each sequence is a token (literal count << 4 |
+// match length - 4, 15 in either half means more length bytes follow, each
+// added until one is below 255), the literals, and a u16 offset back to the
+// match. The last sequence has literals only. Matches are found through a
+// hash table of 4-byte prefixes, without chains: one candidate per position.
+static size_t lz_length(unsigned char* dst, size_t op, size_t len) {
+    for (; len >= 255; len -= 255) dst[op++] = 255;
+    dst[op++] = len;
+    return op;
+}
+
+static size_t lz_sequence(unsigned char* dst, size_t op, const unsigned char* lit, size_t num_lit, 
+                          size_t offset, size_t match) {
+    size_t extra = match >= 4 ? match - 4 : 0;
+    dst[op++] = (num_lit < 15 ? num_lit : 15) << 4 | (extra < 15 ? extra : 15);
+    if (num_lit >= 15) op = lz_length(dst, op, num_lit - 15);
+    memcpy(dst + op, lit, num_lit);
+    op += num_lit;
+    if (!match) return op;
+    dst[op++] = offset;
+    dst[op++] = offset >> 8;
+    return extra >= 15 ? lz_length(dst, op, extra - 15) : op;
+}
+
+// Packs n bytes of src into dst, which holds LZ_BOUND(n)
+static size_t lz_compress(const unsigned char* src, size_t n, unsigned char* dst, uint32_t* table) {
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    size_t ip = 1, anchor = 0, op = 0;
+    while (ip + 4 <= n) {
+        uint32_t seq, cand_seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = ip;
+        memcpy(&cand_seq, src + cand, 4);
+        if (cand_seq != seq || ip - cand > UINT16_MAX) {
+            ip += 1 + ((ip - anchor) >> 6); // Skip faster through data that does not match
+            continue;
+        }
+        size_t len = 4;
+        while (ip + len < n && src[cand + len] == src[ip + len]) len++;
+        op = lz_sequence(dst, op, src + anchor, ip - anchor, ip - cand, len);
+        ip += len;
+        anchor = ip;
+    }
+    return lz_sequence(dst, op, src + anchor, n - anchor, 0, 0);
+}
+
+// Unpacks exactly n bytes into dst; false for anything malformed
+static bool lz_decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t n) {
+    size_t ip = 0, op = 0;
+    while (ip < size) {
+        unsigned token = src[ip++];
+        size_t num_lit = token >> 4, match = token & 15;
+        if (num_lit == 15) {
+            unsigned b;
+            do {
+                if (ip == size) return false;
+                num_lit += b = src[ip++];
+            } while (b == 255 && num_lit <= n);
+        }
+        if (num_lit > size - ip || num_lit > n - op) return false;
+        memcpy(dst + op, src + ip, num_lit);
+        ip += num_lit;
+        op += num_lit;
+        if (ip == size) break;
+
+        if (size - ip < 2) return false;
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (match == 15) {
+            unsigned b;
+            do {
+                if (ip == size) return false;
+                match += b = src[ip++];
+            } while (b == 255 && match <= n);
+        }
+        match += 4;
+        if (!offset || offset > op || match > n - op) return false;
+        const unsigned char* from = dst + op - offset;
+        if (offset >= match) {
+            memcpy(dst + op, from, match);
+        } else {
+            for (size_t i = 0; i < match; i++) dst[op + i] = from[i];
+        }
+        op += match;
+    }
+    return op == n;
+}
+
+// Stream of a compact save, one block in memory
+typedef struct {
+    FILE* f;
+    uint32_t* table;       // Hash table of lz_compress
+    unsigned char* raw;    // Stream bytes of the current block
+    unsigned char* packed;
+    size_t used, pos;
+    bool ok;
+} CompactStream;
+
+static bool compact_open(CompactStream* s, FILE* f) {
+    unsigned char* mem = counted_malloc(COMPACT_MEMORY);
+    *s = (CompactStream){f, (uint32_t*)mem, mem + (sizeof(uint32_t) << LZ_HASH_BITS), NULL, 0, 0, mem != NULL};
+    if (mem) s->packed = s->raw + COMPACT_BLOCK;
+    return s->ok;
+}
+
+static void compact_flush(CompactStream* s) {
+    if (!s->used) return;
+    size_t n = lz_compress(s->raw, s->used, s->packed, s->table);
+    bool stored = n >= s->used;
+    unsigned char h[8];
+    put_u32(h, s->used);
+    put_u32(h + 4, stored ? s->used | COMPACT_STORED : n);
+    if (stored) n = s->used;
+    s->ok = s->ok && fwrite(h, 8, 1, s->f) == 1 && fwrite(stored ? s->raw : s->packed, 1, n, s->f) == n;
+    s->used = 0;
+}
+
+static void compact_put_byte(CompactStream* s, unsigned b) {
+    if (s->used == COMPACT_BLOCK) compact_flush(s);
+    s->raw[s->used++] = b;
+}
+
+static void compact_put_varint(CompactStream* s, uint32_t v) {
+    if (s->used + 5 > COMPACT_BLOCK) compact_flush(s);
+    for (; v >= 0x80; v >>= 7) s->raw[s->used++] = v | 0x80;
+    s->raw[s->used++] = v;
+}
+
+static void compact_put_signed(CompactStream* s, int32_t v) {
+    compact_put_varint(s, (uint32_t)v << 1 ^ (v < 0 ? UINT32_MAX : 0));
+}
+
+// Reads and unpacks the next block
+static bool compact_fill(CompactStream* s) {
+    unsigned char h[8];
+    if (fread(h, 8, 1, s->f) != 1) return false;
+    uint32_t n = get_u32(h), packed = get_u32(h + 4) & ~COMPACT_STORED;
+    bool stored = get_u32(h + 4) & COMPACT_STORED;
+    if (!n || n > COMPACT_BLOCK || packed > LZ_BOUND(COMPACT_BLOCK) || (stored && packed != n) || 
+        fread(stored ? s->raw : s->packed, 1, packed, s->f) != packed || 
+        (!stored && !lz_decompress(s->packed, packed, s->raw, n))) 
+        return false;
+    s->used = n;
+    s->pos = 0;
+    return true;
+}
+
+// 0 once the stream has failed; the caller checks ok when done
+static unsigned compact_byte(CompactStream* s) {
+    if (s->pos == s->used && !(s->ok = s->ok && compact_fill(s))) return 0;
+    return s->raw[s->pos++];
+}
+
+static uint32_t compact_varint(CompactStream* s) {
+    uint32_t v = 0;
+    if (s->used - s->pos >= 5) {
+        // Whole varint in this block: no refill checks
+        const unsigned char* p = s->raw + s->pos;
+        for (int i = 0; i < 5; i++) {
+            v |= (uint32_t)(p[i] & 0x7f) << 7 * i;
+            if (!(p[i] & 0x80)) {
+                s->pos += i + 1;
+                return v;
+            }
+        }
+    } else {
+        for (int shift = 0; shift < 35; shift += 7) {
+            unsigned b = compact_byte(s);
+            v |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+    }
+    s->ok = false;
+    return 0;
+}
+
+static int32_t compact_signed(CompactStream* s) {
+    uint32_t v = compact_varint(s);
+    return (int32_t)(v >> 1 ^ (v & 1 ? UINT32_MAX : 0));
+}
+
+// Room i as it is now; untouched rooms of a mapped save come from their record
+static const Room* saved_room(Dungeon* d, int i, Room* tmp) {
+    if (!d->map) return &d->rooms[i];
+    Room* r = overlay_lookup(d->map, i);
+    if (r) return r;
+    *tmp = mapped_record(d->map, i);
+    return tmp;
+}
+
+static bool save_compact(Dungeon* d, FILE* f) {
+    CompactStream s;
+    if (!compact_open(&s, f)) return false;
+    s.ok = write_save_header(d, f, COMPACT_MAGIC, COMPACT_VERSION);
+
+    Room tmp;
+    for (int i = 0; i < d->num_rooms; i++) {
+        const Room* r = saved_room(d, i, &tmp);
+        int extra = r->max_doors - r->num_doors;
+        RoomContent c = room_content(r);
+        compact_put_byte(&s, r->visited | room_cleared(r) << 1 | c.type << 2 | 
+                             (r->num_doors < 7 ? r->num_doors : 7) << 4 | (extra > 0) << 7);
+        if (r->num_doors >= 7) compact_put_varint(&s, r->num_doors);
+        if (extra > 0) compact_put_varint(&s, extra);
+        if (c.type == MONSTER) {
+            compact_put_varint(&s, c.content.monster.type);
+            compact_put_signed(&s, c.content.monster.hp);
+            compact_put_signed(&s, c.content.monster.damage);
+        } else if (c.type == ITEM) {
+            compact_put_varint(&s, c.content.item.type);
+            compact_put_signed(&s, c.content.item.value);
+        }
+    }
+    for (int i = 0; i < d->num_rooms; i++) {
+        const Room* r = saved_room(d, i, &tmp);
+        for (int j = 0; j < r->num_doors; j++) compact_put_signed(&s, (int32_t)r->doors[j] - i);
+    }
+    compact_flush(&s);
+    free(s.table);
+    return s.ok;
+}
+
+static Dungeon* load_compact(FILE* f, const unsigned char* header) {
+    uint32_t num_rooms = get_u32(header + 8), num_doors = get_u32(header + 12);
+    if (get_u32(header + 4) != COMPACT_VERSION || num_rooms < 1 || num_rooms > INT_MAX) 
+        return NULL;
+
+    Dungeon* d = create_dungeon(num_rooms);
+    CompactStream s;
+    if (!compact_open(&s, f) || !d) {
+        if (d) free_dungeon(d);
+        free(s.table);
+        return NULL;
+    }
+    d->player = get_player(header + 16);
+    d->compact = true;
+
+    // Rooms; the door count must add up to the header's
+    uint32_t doors = 0;
+    for (uint32_t i = 0; s.ok && i < num_rooms; i++) {
+        unsigned b = compact_byte(&s);
+        uint32_t n = b >> 4 & 7;
+        if (n == 7) n = compact_varint(&s);
+        uint32_t max = n + (b & 0x80 ? compact_varint(&s) : 0);
+        RoomContent c = {.type = b >> 2 & 3};
+        if (c.type == MONSTER) {
+            Monster* m = &c.content.monster;
+            m->type = compact_varint(&s);
+            m->hp = compact_signed(&s);
+            m->damage = compact_signed(&s);
+            s.ok = s.ok && m->type < MAX_MONSTER_TYPES && state_fits(m->hp) && state_fits(m->damage);
+        } else if (c.type == ITEM) {
+            c.content.item.type = compact_varint(&s);
+            c.content.item.value = compact_signed(&s);
+            s.ok = s.ok && c.content.item.type < MAX_ITEM_TYPES && state_fits(c.content.item.value);
+        }
+        if (!s.ok || max < 1 || max > UINT8_MAX || n > max) {
+            s.ok = false;
+            break;
+        }
+        Room* r = create_room(d, i, max);
+        r->num_doors = n;
+        r->visited = b & 1;
+        room_set(r, c, b & 2);
+        doors += n;
+    }
+    bool ok = s.ok && doors == num_doors && assign_door_rows(d);
+
+    for (uint32_t i = 0; ok && i < num_rooms; i++) {
+        Room* r = &d->rooms[i];
+        for (int j = 0; ok && j < r->num_doors; j++) {
+            int64_t id = (int64_t)i + compact_signed(&s);
+            ok = s.ok && id >= 0 && id < num_rooms;
+            r->doors[j] = id;
+        }
+    }
+
+    free(s.table);
+    if (!ok) {
+        free_dungeon(d);
+        return NULL;
+    }
+    return d;
+}
+
+// Writes to a temporary file and renames it over filename, so a save never
+// truncates a file that is still mapped by load_game_mapped
+bool save_game(Dungeon* d, const char* filename) {
+    char tmp[FILENAME_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp)) return false;
+    FILE* f = fopen(tmp, "wb");
+    if (!f) return false;
+    STAT_BEGIN(save);
+    bool ok = d->lazy ? save_lazy(d, f) : d->compact ? save_compact(d, f) : save_rooms(d, f);
+    STAT_ADD(save_bytes_written, ftell(f));
+    ok = fclose(f) == 0 && ok && rename(tmp, filename) == 0;
+    if (!ok) remove(tmp);
+    else journal_discard(d, filename); // A journal of the old save does not apply to this one
+    STAT_END(save);
+    return ok;
+}
+
+// Player and rooms of a save in the original format: raw Player struct and
+// one field per call. Every field is checked as load_game_v2 checks its records.
+static bool read_rooms_v1(Dungeon* d, FILE* f) {
+    int num_rooms = d->num_rooms;
+    if (fread(&d->player, sizeof(Player), 1, f) != 1) return false;
+
+    // First pass: create all rooms
+    for (int i = 0; i < num_rooms; i++) {
+        int id, num_doors, max_doors;
+        bool visited, cleared;
+        ContentType type;
+        
+        if (fread(&id, sizeof(int), 1, f) != 1 || fread(&num_doors, sizeof(int), 1, f) != 1 ||
+            fread(&max_doors, sizeof(int), 1, f) != 1 || fread(&visited, sizeof(bool), 1, f) != 1 ||
+            fread(&cleared, sizeof(bool), 1, f) != 1 || fread(&type, sizeof(ContentType), 1, f) != 1) 
+            return false;
+
+        // Every id must map to its own slot in the room table
+        if (id < 0 || id >= num_rooms || d->rooms[id].max_doors || (unsigned)type > TREASURE || 
+            max_doors < 1 || max_doors > UINT8_MAX || num_doors < 0 || num_doors > max_doors) 
+            return false;
+
+        Room* r = create_room(d, id, max_doors);
+        r->num_doors = num_doors;
+        r->visited = visited;
+        RoomContent c = {.type = type};
+
+        if (type == MONSTER) {
+            Monster* m = &c.content.monster;
+            if (fread(&m->type, sizeof(MonsterType), 1, f) != 1 || fread(&m->hp, sizeof(int), 1, f) != 1 ||
+                fread(&m->damage, sizeof(int), 1, f) != 1 || (unsigned)m->type >= MAX_MONSTER_TYPES || 
+                !state_fits(m->hp) || !state_fits(m->damage)) 
+                return false;
+        } else if (type == ITEM) {
+            Item* it = &c.content.item;
+            if (fread(&it->type, sizeof(ItemType), 1, f) != 1 || fread(&it->value, sizeof(int), 1, f) != 1 ||
+                (unsigned)it->type >= MAX_ITEM_TYPES || !state_fits(it->value)) 
+                return false;
+        }
+        room_set(r, c, cleared);
+    }
+
+    // Second pass: connect doors
+    if (!assign_door_rows(d)) return false;
+    FOR_EACH_ROOM(d, r) {
+        for (int j = 0; j < r->num_doors; j++) {
+            int id;
+            if (fread(&id, sizeof(int), 1, f) != 1 || id < 0 || id >= num_rooms) return false;
+            r->doors[j] = id;
+        }
+    }
+    return true;
+}
+
+static Dungeon* load_game_v1(FILE* f) {
+    int num_rooms;
+    if (fread(&num_rooms, sizeof(int), 1, f) != 1 || num_rooms < 1) return NULL;
+
+    Dungeon* d = create_dungeon(num_rooms);
+    if (d && !read_rooms_v1(d, f)) {
+        fprintf(stderr, "Save in het oude formaat is afgekapt of beschadigd\n");
+        free_dungeon(d);
+        return NULL;
+    }
+    return d;
+}
+
+static Dungeon* load_game_v2(FILE* f, const unsigned char* header) {
+    uint32_t num_rooms = get_u32(header + 8), num_doors = get_u32(header + 12);
+    if (get_u32(header + 4) != SAVE_VERSION || num_rooms < 1 || num_rooms > INT_MAX) 
+        return NULL;
+
+    Dungeon* d = create_dungeon(num_rooms);
+    unsigned char* buf = counted_malloc(SAVE_CHUNK * SAVE_ROOM_SIZE);
+    if (!d || !buf) {
+        if (d) free_dungeon(d);
+        free(buf);
+        return NULL;
+    }
+    d->player = get_player(header + 16);
+
+    // Room records; first_door must match the running door count
+    bool ok = true;
+    uint32_t expected_door = 0;
+    for (uint32_t i = 0; ok && i < num_rooms; ) {
+        uint32_t n = num_rooms - i < SAVE_CHUNK ? num_rooms - i : SAVE_CHUNK;
+        ok = fread(buf, SAVE_ROOM_SIZE, n, f) == n;
+        for (uint32_t k = 0; ok && k < n; k++, i++) {
+            const unsigned char* p = buf + k * SAVE_ROOM_SIZE;
+            if (!valid_room_record(p, expected_door)) {
+                ok = false;
+                break;
+            }
+            expected_door += p[4];
+
+            Room* r = create_room(d, i, p[5]);
+            r->num_doors = p[4];
+            r->visited = p[6] & ROOM_VISITED;
+            room_set(r, restore_content(p), p[6] & ROOM_CLEARED);
+        }
+    }
+    ok = ok && expected_door == num_doors && assign_door_rows(d);
+
+    // Door block: one pass in room order, resolved straight through the room table
+    uint32_t per_chunk = SAVE_CHUNK * SAVE_ROOM_SIZE / 4, remaining = num_doors, avail = 0, pos = 0;
+    for (int i = 0; ok && i < d->num_rooms; i++) {
+        Room* r = &d->rooms[i];
+        for (int j = 0; ok && j < r->num_doors; j++) {
+            if (pos == avail) {
+                avail = remaining < per_chunk ? remaining : per_chunk;
+                ok = fread(buf, 4, avail, f) == avail;
+                remaining -= avail;
+                pos = 0;
+            }
+            uint32_t id = get_u32(buf + 4 * pos++);
+            ok = ok && id < num_rooms;
+            r->doors[j] = id;
+        }
+    }
+
+    free(buf);
+    if (!ok) {
+        free_dungeon(d);
+        return NULL;
+    }
+    return d;
+}
+
+Dungeon* load_game(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return NULL;
+
+    STAT_BEGIN(load);
+    unsigned char header[SAVE_HEADER_SIZE];
+    Dungeon* d;
+    bool full = fread(header, SAVE_HEADER_SIZE, 1, f) == 1;
+    if (full && memcmp(header, SAVE_MAGIC, 4) == 0) {
+        d = load_game_v2(f, header);
+    } else if (full && memcmp(header, LAZY_MAGIC, 4) == 0) {
+        d = load_lazy(f, header);
+    } else if (full && memcmp(header, COMPACT_MAGIC, 4) == 0) {
+        d = load_compact(f, header);
+    } else {
+        rewind(f);
+        d = load_game_v1(f);
+    }
+    STAT_ADD(load_bytes_read, ftell(f));
+    fclose(f);
+
+    if (d) {
+        d->entrance = find_room_by_id(d, 0);
+        if (!journal_replay(d, filename) || !find_room_by_id(d, d->player.current_room_id)) {
+            free_dungeon(d);
+            d = NULL;
+        }
+    }
+    STAT_END(load);
+    return d;
+}
+
+// Journal
+// journal_save writes a full save the first time, then appends only what
+// changed to <save>.jnl: the player when it differs from the last record and
+// the rooms passed to journal_touch. Records hold absolute values, so replaying
+// them in order onto the save gives the latest state. The journal header
+// identifies the save it belongs to by size and modification time, and by a
+// hash taken when the save was written; a journal left behind by a crash
+// between a new save and the fresh journal no longer matches and is ignored.
+// Loading only hashes the save again when size or time differ (a copied
+// save), so a mapped load still reads nothing it does not touch.
+// Doors never change during play, so records only carry flags and content.
+//   header:  magic "DNGJ", u32 version, u64 size, u64 mtime in ns and u64
+//            FNV-1a hash of the save
+//   player:  u8 JOURNAL_PLAYER, then the 17 player bytes of the save header
+//   room:    u8 JOURNAL_ROOM, u32 id, then bytes 6 to 19 of its room record
+// A torn record at the end is dropped on load.
+#define JOURNAL_MAGIC "DNGJ"
+#define JOURNAL_VERSION 2 // 2: size and mtime of the save
+#define JOURNAL_HEADER_SIZE 32
+#define JOURNAL_PLAYER 1
+#define JOURNAL_ROOM 2
+#define JOURNAL_PLAYER_SIZE 18
+#define JOURNAL_ROOM_SIZE 19
+#define JOURNAL_COMPACT_MIN 65536 // A journal larger than this and the save is compacted
+
+static uint64_t file_hash(const char* filename, long* size) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return 0;
+    unsigned char buf[65536];
+    uint64_t h = 0xCBF29CE484222325ull;
+    size_t n;
+    *size = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (size_t i = 0; i < n; i++) h = (h ^ buf[i]) * 0x100000001B3ull;
+        *size += n;
+    }
+    fclose(f);
+    return h;
+}
+
+// Size and modification time in ns, 0 when unknown
+static void file_stamp(const char* filename, uint64_t* size, uint64_t* mtime) {
+    *size = *mtime = 0;
+#ifdef HAVE_MMAP
+    struct stat st;
+    if (stat(filename, &st) != 0) return;
+    *size = st.st_size;
+#ifdef __APPLE__
+    *mtime = st.st_mtimespec.tv_sec * 1000000000ull + st.st_mtimespec.tv_nsec;
+#else
+    *mtime = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+#endif
+#else
+    (void)filename;
+#endif
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+    return get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void journal_close(Dungeon* d) {
+    Journal* j = d->journal;
+    if (!j) return;
+    if (j->f) fclose(j->f);
+    free(j->snapshot); free(j->dirty); free(j->dirty_ids); free(j);
+    d->journal = NULL;
+}
+
+static uint32_t* journal_slot(Journal* j, int id) {
+    uint32_t i = ((uint32_t)id * 2654435761u) & (j->dirty_cap - 1);
+    while (j->dirty[i] && j->dirty[i] != (uint32_t)id + 1) i = (i + 1) & (j->dirty_cap - 1);
+    return &j->dirty[i];
+}
+
+// The set is sized by the changes between two saves, not by the dungeon
+void journal_touch(Dungeon* d, int id) {
+    Journal* j = d->journal;
+    if (!j || *journal_slot(j, id)) return;
+    if ((j->num_dirty + 1) * 2 > j->dirty_cap) {
+        uint32_t* set = counted_calloc(j->dirty_cap * 2, sizeof(uint32_t));
+        int32_t* ids = counted_malloc(j->dirty_cap * sizeof(int32_t));
+        if (!set || !ids) {
+            free(set); free(ids);
+            journal_close(d); // The next save starts over with a full save
+            return;
+        }
+        memcpy(ids, j->dirty_ids, j->num_dirty * sizeof(int32_t));
+        free(j->dirty); free(j->dirty_ids);
+        j->dirty = set;
+        j->dirty_ids = ids;
+        j->dirty_cap *= 2;
+        for (int i = 0; i < j->num_dirty; i++) *journal_slot(j, ids[i]) = ids[i] + 1;
+    }
+    *journal_slot(j, id) = id + 1;
+    j->dirty_ids[j->num_dirty++] = id;
+}
+
+// Full save plus an empty journal that belongs to it
+static bool journal_snapshot(Dungeon* d, const char* filename) {
+    journal_close(d);
+    if (!save_game(d, filename)) return false;
+
+    char path[FILENAME_MAX];
+    Journal* j = counted_calloc(1, sizeof(Journal));
+    if (!j || snprintf(path, sizeof(path), "%s.jnl", filename) >= (int)sizeof(path)) {
+        free(j);
+        return true; // Saved; the next save tries the journal again
+    }
+    d->journal = j;
+    j->snapshot = counted_malloc(strlen(filename) + 1);
+    j->dirty_cap = 64;
+    j->dirty = counted_calloc(j->dirty_cap, sizeof(uint32_t));
+    j->dirty_ids = counted_malloc(j->dirty_cap / 2 * sizeof(int32_t));
+    j->f = fopen(path, "wb");
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    uint64_t size, mtime, hash = file_hash(filename, &j->snapshot_size);
+    file_stamp(filename, &size, &mtime);
+    memcpy(header, JOURNAL_MAGIC, 4);
+    put_u32(header + 4, JOURNAL_VERSION);
+    put_u64(header + 8, size);
+    put_u64(header + 16, mtime);
+    put_u64(header + 24, hash);
+    if (!j->snapshot || !j->dirty || !j->dirty_ids || !j->f || 
+        fwrite(header, JOURNAL_HEADER_SIZE, 1, j->f) != 1 || fflush(j->f) != 0) {
+        journal_close(d);
+        remove(path);
+        return true;
+    }
+    strcpy(j->snapshot, filename);
+    j->size = JOURNAL_HEADER_SIZE;
+    put_player(j->player, &d->player);
+    return true;
+}
+
+bool journal_save(Dungeon* d, const char* filename) {
+    Journal* j = d->journal;
+    if (!j || strcmp(j->snapshot, filename) != 0 || 
+        (j->size > JOURNAL_COMPACT_MIN && j->size > j->snapshot_size)) 
+        return journal_snapshot(d, filename);
+
+    unsigned char buf[4096];
+    size_t n = 0;
+    bool ok = true;
+    put_player(buf + 1, &d->player);
+    if (memcmp(j->player, buf + 1, sizeof(j->player)) != 0) {
+        buf[0] = JOURNAL_PLAYER;
+        memcpy(j->player, buf + 1, sizeof(j->player));
+        n = JOURNAL_PLAYER_SIZE;
+    }
+    for (int i = 0; i < j->num_dirty; i++) {
+        if (n + JOURNAL_ROOM_SIZE > sizeof(buf)) {
+            ok = ok && fwrite(buf, 1, n, j->f) == n;
+            j->size += n;
+            n = 0;
+        }
+        int id = j->dirty_ids[i];
+        unsigned char rec[SAVE_ROOM_SIZE];
+        put_room_state(rec, find_room_by_id(d, id));
+        buf[n] = JOURNAL_ROOM;
+        put_u32(buf + n + 1, id);
+        memcpy(buf + n + 5, rec + 6, SAVE_ROOM_SIZE - 6);
+        n += JOURNAL_ROOM_SIZE;
+    }
+    ok = ok && fwrite(buf, 1, n, j->f) == n && fflush(j->f) == 0;
+    j->size += n;
+    j->num_dirty = 0;
+    memset(j->dirty, 0, j->dirty_cap * sizeof(uint32_t));
+    // A failed append may have left a partial record; start over with a full save
+    return ok || journal_snapshot(d, filename);
+}
+
+// Removes the journal of filename; the next journal_save starts with a full save
+void journal_discard(Dungeon* d, const char* filename) {
+    char path[FILENAME_MAX];
+    if (d->journal && strcmp(d->journal->snapshot, filename) == 0) journal_close(d);
+    if (snprintf(path, sizeof(path), "%s.jnl", filename) < (int)sizeof(path)) remove(path);
+}
+
+// Applies <filename>.jnl when it belongs to filename; false on a bad record
+bool journal_replay(Dungeon* d, const char* filename) {
+    char path[FILENAME_MAX];
+    if (snprintf(path, sizeof(path), "%s.jnl", filename) >= (int)sizeof(path)) return true;
+    FILE* f = fopen(path, "rb");
+    if (!f) return true;
+
+    unsigned char header[JOURNAL_HEADER_SIZE], rec[SAVE_ROOM_SIZE];
+    uint64_t size, mtime;
+    file_stamp(filename, &size, &mtime);
+    bool ok = fread(header, JOURNAL_HEADER_SIZE, 1, f) == 1 && memcmp(header, JOURNAL_MAGIC, 4) == 0 && 
+              get_u32(header + 4) == JOURNAL_VERSION;
+    if (ok && (!mtime || get_u64(header + 8) != size || get_u64(header + 16) != mtime)) {
+        long hashed;
+        ok = file_hash(filename, &hashed) == get_u64(header + 24);
+    }
+    if (!ok) {
+        fclose(f);
+        return true; // Stale or foreign journal
+    }
+    for (int kind; ok && (kind = fgetc(f)) != EOF; ) {
+        if (kind == JOURNAL_PLAYER) {
+            if (fread(rec, JOURNAL_PLAYER_SIZE - 1, 1, f) != 1) break;
+            d->player = get_player(rec);
+        } else if (kind == JOURNAL_ROOM) {
+            if (fread(rec, 4, 1, f) != 1 || fread(rec + 6, SAVE_ROOM_SIZE - 6, 1, f) != 1) break;
+            Room* r = find_room_by_id(d, get_u32(rec));
+            ok = r && valid_room_state(rec);
+            if (!ok) break;
+            r->visited = rec[6] & ROOM_VISITED;
+            room_set(r, restore_content(rec), rec[6] & ROOM_CLEARED);
+        } else {
+            ok = false;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+// Record and replay
+// A trace holds what it takes to play a session again: how the dungeon was
+// made and every choice the player made. Replay runs headless at full speed
+// and checks every turn against a checksum of the state when it was recorded.
+//   header: magic "DNGT", u32 version, u8 kind, u32 rooms, u32 resident, u64 seed
+//   turn:   u8 action (1-6), u32 checksum of the state before it, then the
+//           target room as a varint when the action is 1
+//   end:    u8 0, u32 checksum of the final state
+// The checksum covers the player, the generator and the current room, which
+// is everything an action reads, so a divergence shows up at the turn it happens.
+#define TRACE_MAGIC "DNGT"
+#define TRACE_VERSION 2 // 2: monsters and items roll only their own ranges
+#define TRACE_HEADER_SIZE 25
+
+uint32_t state_checksum(Dungeon* d) {
+    unsigned char buf[17 + 32 + SAVE_ROOM_SIZE] = {0};
+    put_player(buf, &d->player);
+    for (int i = 0; i < 4; i++) {
+        put_u32(buf + 17 + 8 * i, (uint32_t)d->rng.s[i]);
+        put_u32(buf + 21 + 8 * i, (uint32_t)(d->rng.s[i] >> 32));
+    }
+    Room* r = find_room_by_id(d, d->player.current_room_id);
+    if (r) put_room_state(buf + 49, r);
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(buf); i++) h = (h ^ buf[i]) * 16777619u;
+    return h;
+}
+
+static void trace_put_varint(FILE* f, uint32_t v) {
+    for (; v >= 0x80; v >>= 7) fputc((v & 0x7F) | 0x80, f);
+    fputc(v, f);
+}
+
+static bool trace_get_varint(FILE* f, uint32_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF) return false;
+        *v |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+// Starts a trace of a new game made as described by how
+Trace* trace_create(const char* filename, const Trace* how) {
+    Trace* t = malloc(sizeof(Trace));
+    if (!t) return NULL;
+    *t = *how;
+    t->failed_turn = 0;
+    if (!(t->f = fopen(filename, "wb"))) {
+        free(t);
+        return NULL;
+    }
+    unsigned char h[TRACE_HEADER_SIZE];
+    memcpy(h, TRACE_MAGIC, 4);
+    put_u32(h + 4, TRACE_VERSION);
+    h[8] = t->kind;
+    put_u32(h + 9, t->rooms);
+    put_u32(h + 13, t->resident);
+    put_u32(h + 17, (uint32_t)t->seed);
+    put_u32(h + 21, (uint32_t)(t->seed >> 32));
+    fwrite(h, 1, sizeof(h), t->f);
+    return t;
+}
+
+static Trace* trace_open(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return NULL;
+    unsigned char h[TRACE_HEADER_SIZE];
+    Trace* t = NULL;
+    if (fread(h, 1, sizeof(h), f) == sizeof(h) && memcmp(h, TRACE_MAGIC, 4) == 0 && 
+        get_u32(h + 4) == TRACE_VERSION && h[8] <= TRACE_PARALLEL && (t = malloc(sizeof(Trace)))) {
+        *t = (Trace){f, h[8], (int32_t)get_u32(h + 9), (int32_t)get_u32(h + 13), 
+                     get_u32(h + 17) | (uint64_t)get_u32(h + 21) << 32, 0};
+        return t;
+    }
+    fclose(f);
+    return NULL;
+}
+
+static void trace_close(Trace* t) {
+    fclose(t->f);
+    free(t);
+}
+
+// The dungeon main makes for the same options
+static Dungeon* trace_dungeon(const Trace* t) {
+    if (t->kind == TRACE_LAZY) return generate_lazy_dungeon(t->rooms, t->seed, t->resident);
+    if (t->kind == TRACE_PARALLEL) {
+        Dungeon* d = generate_dungeon_parallel(t->rooms, t->seed, t->resident);
+        if (d) populate_rooms_parallel(d, t->resident);
+        return d;
+    }
+    Dungeon* d = generate_dungeon(t->rooms, t->seed);
+    if (d) populate_rooms(d);
+    return d;
+}
+
+int record_action(Policy* p, Dungeon* d, Room* current) {
+    TracePolicy* tp = (TracePolicy*)p;
+    unsigned char rec[5];
+    put_u32(rec + 1, state_checksum(d)); // Before inner runs, it may draw from the generator
+    rec[0] = tp->inner->choose_action(tp->inner, d, current);
+    fwrite(rec, 1, sizeof(rec), tp->trace->f);
+    return rec[0];
+}
+
+int record_door(Policy* p, Dungeon* d, Room* current) {
+    TracePolicy* tp = (TracePolicy*)p;
+    int target = tp->inner->choose_door(tp->inner, d, current);
+    trace_put_varint(tp->trace->f, target);
+    return target;
+}
+
+// Ends the game on the first turn that differs from the recording
+int replay_action(Policy* p, Dungeon* d, Room* current) {
+    (void)current;
+    Trace* t = ((TracePolicy*)p)->trace;
+    unsigned char rec[5];
+    if (fread(rec, 1, sizeof(rec), t->f) != sizeof(rec) || rec[0] < 1 || rec[0] > 6 || 
+        get_u32(rec + 1) != state_checksum(d)) {
+        t->failed_turn = d->turns;
+        return 6;
+    }
+    return rec[0] == 5 ? 3 : rec[0]; // Saves are not repeated; a status changes nothing either
+}
+
+int replay_door(Policy* p, Dungeon* d, Room* current) {
+    Trace* t = ((TracePolicy*)p)->trace;
+    uint32_t target;
+    if (!trace_get_varint(t->f, &target) || target > INT_MAX) {
+        t->failed_turn = d->turns;
+        return current->id;
+    }
+    return target;
+}
+
+// Writes the end record and closes the trace
+bool trace_finish(Trace* t, Dungeon* d) {
+    unsigned char rec[5] = {0};
+    put_u32(rec + 1, state_checksum(d));
+    bool ok = fwrite(rec, 1, sizeof(rec), t->f) == sizeof(rec) && !ferror(t->f);
+    ok = fclose(t->f) == 0 && ok;
+    free(t);
+    return ok;
+}
+
+// Plays filename again up to turn stop (0 = to the end). Returns the dungeon
+// after the last replayed turn, or NULL with the first turn that did not
+// match in failed_turn (0 when the trace could not be read).
+Dungeon* replay_trace(const char* filename, int stop, int* failed_turn) {
+    *failed_turn = 0;
+    Trace* t = trace_open(filename);
+    if (!t) return NULL;
+    Dungeon* d = trace_dungeon(t);
+    if (d) {
+        TracePolicy replay = {{replay_action, replay_door, stop}, NULL, t};
+        d->headless = true;
+        game_loop(d, &replay.base);
+        if (!t->failed_turn && !(stop && d->turns >= stop)) {
+            unsigned char rec[5];
+            if (fread(rec, 1, sizeof(rec), t->f) != sizeof(rec) || rec[0] != 0 || 
+                get_u32(rec + 1) != state_checksum(d)) 
+                t->failed_turn = d->turns ? d->turns : 1;
+        }
+        if ((*failed_turn = t->failed_turn)) {
+            free_dungeon(d);
+            d = NULL;
+        }
+    }
+    trace_close(t);
+    return d;
+}
+
+// Replays every trace to the end and reports the ones that differ
+int replay_corpus(char** files, int count) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = 0;
+    long turns = 0;
+    for (int i = 0; i < count; i++) {
+        int turn;
+        Dungeon* d = replay_trace(files[i], 0, &turn);
+        if (d) {
+            turns += d->turns;
+            free_dungeon(d);
+        } else {
+            failed++;
+            if (turn) printf("%s: wijkt af in beurt %d\n", files[i], turn);
+            else printf("%s: kon trace niet lezen\n", files[i]);
+        }
+    }
+    double seconds = elapsed_seconds(&start);
+    printf("Traces: %d, afwijkend: %d, beurten: %ld (%.0f traces/s)\n", 
+           count, failed, turns, seconds > 0 ? count / seconds : 0.0);
+    return failed ? 1 : 0;
+}
+
+// Server
+// -S hosts many games in one process. Clients connect to a Unix socket and
+// send lines "<session> <command>", so one connection can carry any number
+// of sessions:
+//   <s> new <rooms> [seed]   starts a game, replacing any game with that id
+//   <s> <1-6> [room]         one menu action; the room is the target of 1
+//   <s> end                  drops the game
+// Every command is answered with the game's output, each line prefixed with
+// "<s> ", then a last line "<s> ok|won|died|quit|error". Saving (5) is refused.
+// Session ids belong to the connection: two clients can both play session 1.
+// The main thread only runs epoll and splits lines. A session always goes to
+// worker id % workers, which owns it, so sessions need no locks and the
+// commands of one session run in order. Sessions come from per-worker slabs.
+// When a client leaves, every worker gets an empty line for it and drops the
+// games it still holds for that connection.
+#ifdef HAVE_EPOLL
+#define SERVER_LINE_MAX 128
+#define SERVER_MAX_ROOMS 1000000
+#define SESSION_SLAB 1024
+
+typedef struct Connection Connection;
+
+typedef struct Session {
+    uint32_t id;
+    Connection* conn;
+    Dungeon* d;
+    struct Session* next; // Hash chain, or the free list
+    struct Session *conn_prev, *conn_next; // Sessions of conn at this worker
+} Session;
+
+struct Connection {
+    int fd;
+    char in[4096];
+    size_t in_used;
+    pthread_mutex_t lock; // Guards everything below
+    char* out;
+    size_t out_used, out_cap;
+    int pending;          // Commands queued at the workers
+    bool closed, flush_queued;
+    struct Connection* next_flush;
+    bool dead;            // Freed at the end of the current batch of events
+    struct Connection *prev, *next; // All connections, or the dead ones
+    Session** sessions;   // Per worker, touched by that worker only
+};
+
+typedef struct Server Server;
+
+typedef struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char* queue;           // Records of Connection* then a NUL-terminated line
+    size_t used, cap;
+    bool stop;
+    Session** table;       // id -> session, chained
+    uint32_t mask;
+    int count;
+    Session* free_sessions;
+    Session** slabs;
+    int num_slabs;
+    Sink sink;             // Output of the command being run
+    Connection* conn;      // Where the sink drains to
+    uint32_t session_id;
+    bool line_start;
+    long commands;
+    Server* server;
+} Worker;
+
+struct Server {
+    int epoll_fd, listen_fd, wake_pipe[2];
+    Worker* workers;
+    int num_workers;
+    pthread_mutex_t flush_lock;
+    Connection* flush_list; // Connections with new output, for the main thread
+    Connection* conns;      // Open connections, main thread only
+    Connection* dead;       // Done connections, freed once no event of the batch can name them
+};
+
+static volatile sig_atomic_t server_stopping;
+static int server_signal_fd = -1;
+
+static void server_signal(int sig) {
+    (void)sig;
+    server_stopping = 1;
+    if (write(server_signal_fd, "s", 1) < 0) return;
+}
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Appends to the output of c; the caller holds c->lock
+static bool conn_append(Connection* c, const char* data, size_t len) {
+    if (c->out_used + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_used + len) cap *= 2;
+        char* out = realloc(c->out, cap);
+        if (!out) return false;
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_used, data, len);
+    c->out_used += len;
+    return true;
+}
+
+// Sink drain of a worker: every line gets the session id in front
+static void worker_drain(Sink* s, const char* data, size_t len) {
+    Worker* w = s->ctx;
+    char prefix[16];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%u ", w->session_id);
+    pthread_mutex_lock(&w->conn->lock);
+    while (len) {
+        const char* nl = memchr(data, '\n', len);
+        size_t n = nl ? (size_t)(nl - data) + 1 : len;
+        if (w->line_start) conn_append(w->conn, prefix, prefix_len);
+        conn_append(w->conn, data, n);
+        w->line_start = nl != NULL;
+        data += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&w->conn->lock);
+}
+
+static uint32_t session_hash(const Connection* c, uint32_t id) {
+    return (id ^ (uint32_t)((uintptr_t)c >> 4)) * 2654435761u;
+}
+
+static Session** session_slot(Worker* w, Connection* c, uint32_t id) {
+    Session** s = &w->table[session_hash(c, id) & w->mask];
+    while (*s && ((*s)->id != id || (*s)->conn != c)) s = &(*s)->next;
+    return s;
+}
+
+static Session* session_add(Worker* w, Connection* c, uint32_t id) {
+    if ((uint32_t)w->count > w->mask) {
+        // Rehash into twice the chains
+        uint32_t old_mask = w->mask;
+        Session** old = w->table;
+        Session** table = calloc((size_t)(old_mask + 1) * 2, sizeof(Session*));
+        if (!table) return NULL;
+        w->table = table;
+        w->mask = old_mask * 2 + 1;
+        for (uint32_t i = 0; i <= old_mask; i++) {
+            for (Session* s = old[i], *next; s; s = next) {
+                next = s->next;
+                Session** slot = &w->table[session_hash(s->conn, s->id) & w->mask];
+                s->next = *slot;
+                *slot = s;
+            }
+        }
+        free(old);
+    }
+    if (!w->free_sessions) {
+        Session** slabs = realloc(w->slabs, (w->num_slabs + 1) * sizeof(Session*));
+        Session* slab = slabs ? malloc(SESSION_SLAB * sizeof(Session)) : NULL;
+        if (slabs) w->slabs = slabs;
+        if (!slab) return NULL;
+        w->slabs[w->num_slabs++] = slab;
+        for (int i = 0; i < SESSION_SLAB; i++) {
+            slab[i].next = w->free_sessions;
+            w->free_sessions = &slab[i];
+        }
+    }
+    Session* s = w->free_sessions;
+    w->free_sessions = s->next;
+    Session** slot = session_slot(w, c, id);
+    Session** head = &c->sessions[w - w->server->workers];
+    *s = (Session){id, c, NULL, NULL, NULL, *head};
+    if (*head) (*head)->conn_prev = s;
+    *head = s;
+    *slot = s;
+    w->count++;
+    return s;
+}
+
+static void session_remove(Worker* w, Session** slot) {
+    Session* s = *slot;
+    *slot = s->next;
+    if (s->conn_prev) s->conn_prev->conn_next = s->conn_next;
+    else s->conn->sessions[w - w->server->workers] = s->conn_next;
+    if (s->conn_next) s->conn_next->conn_prev = s->conn_prev;
+    free_dungeon(s->d);
+    s->next = w->free_sessions;
+    w->free_sessions = s;
+    w->count--;
+}
+
+// Runs one command line and returns its status word
+static const char* session_command(Worker* w, const char* line) {
+    char word[16];
+    unsigned long id;
+    int rooms = 0, target = -1, used = 0;
+    unsigned long long seed = 0;
+    w->session_id = strtoul(line, NULL, 10); // Also answers lines that do not parse
+    if (sscanf(line, "%lu %15s%n", &id, word, &used) != 2 || id > UINT32_MAX) return "error";
+    Session** slot = session_slot(w, w->conn, id);
+
+    if (strcmp(word, "new") == 0) {
+        int fields = sscanf(line + used, "%d %llu", &rooms, &seed);
+        if (fields < 1 || rooms < 3 || rooms > SERVER_MAX_ROOMS) return "error";
+        if (fields < 2) seed = time(NULL);
+        Dungeon* d = generate_dungeon(rooms, seed);
+        if (!d) return "error";
+        populate_rooms(d);
+        if (*slot) session_remove(w, slot);
+        Session* s = session_add(w, w->conn, id);
+        if (!s) {
+            free_dungeon(d);
+            return "error";
+        }
+        s->d = d;
+        d->headless = true;
+        d->out = &w->sink;
+        Room* entrance = find_room_by_id(d, d->player.current_room_id);
+        EMIT(d, EV_START, entrance->id, false);
+        print_room(d, entrance);
+        print_doors(d, entrance);
+        return "ok";
+    }
+    if (!*slot) return "error";
+    if (strcmp(word, "end") == 0) {
+        session_remove(w, slot);
+        return "quit";
+    }
+
+    char* end;
+    long action = strtol(word, &end, 10);
+    if (*end || action < 1 || action > 6 || action == 5) return "error";
+    if (action == 1 && sscanf(line + used, "%d", &target) != 1) return "error";
+    Dungeon* d = (*slot)->d;
+    Room* current = find_room_by_id(d, d->player.current_room_id);
+    current->visited = true;
+    d->turns++;
+    StepResult result = game_step(d, current, action, target);
+    if (result == STEP_CONTINUE && d->player.has_treasure) {
+        EMIT(d, EV_END, true);
+        session_remove(w, slot);
+        return "won";
+    }
+    if (result != STEP_CONTINUE) {
+        session_remove(w, slot);
+        return result == STEP_DIED ? "died" : "quit";
+    }
+    print_doors(d, find_room_by_id(d, d->player.current_room_id));
+    return "ok";
+}
+
+static void server_wake(Server* srv) {
+    if (write(srv->wake_pipe[1], "w", 1) < 0) return; // A full pipe already wakes the main thread
+}
+
+static void* worker_main(void* arg) {
+    Worker* w = arg;
+    char* batch = NULL;
+    size_t batch_cap = 0;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->used && !w->stop) pthread_cond_wait(&w->wake, &w->lock);
+        if (!w->used) break;
+        // Swap the queue for the (empty) batch buffer and run it unlocked
+        char* queue = w->queue;
+        size_t used = w->used, cap = w->cap;
+        w->queue = batch;
+        w->cap = batch_cap;
+        w->used = 0;
+        batch = queue;
+        batch_cap = cap;
+        pthread_mutex_unlock(&w->lock);
+
+        for (size_t off = 0; off < used; ) {
+            Connection* c;
+            memcpy(&c, batch + off, sizeof(c));
+            const char* line = batch + off + sizeof(c);
+            off += sizeof(c) + strlen(line) + 1;
+
+            char tail[32];
+            int n = 0;
+            if (*line) {
+                w->conn = c;
+                w->line_start = true;
+                const char* status = session_command(w, line);
+                sink_flush(&w->sink);
+                n = snprintf(tail, sizeof(tail), "%s%u %s\n", w->line_start ? "" : "\n", w->session_id, status);
+                w->commands++;
+            } else {
+                // The client left: drop its games here
+                for (Session* s; (s = c->sessions[w - w->server->workers]); ) 
+                    session_remove(w, session_slot(w, c, s->id));
+            }
+
+            bool wake = false;
+            pthread_mutex_lock(&c->lock);
+            if (n) conn_append(c, tail, n);
+            c->pending--;
+            if (!c->flush_queued) {
+                c->flush_queued = wake = true;
+                pthread_mutex_lock(&w->server->flush_lock);
+                c->next_flush = w->server->flush_list;
+                w->server->flush_list = c;
+                pthread_mutex_unlock(&w->server->flush_lock);
+            }
+            pthread_mutex_unlock(&c->lock);
+            if (wake) server_wake(w->server);
+        }
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(batch);
+    return NULL;
+}
+
+static void worker_free(Worker* w) {
+    for (uint32_t i = 0; w->table && i <= w->mask; i++)
+        for (Session* s = w->table[i]; s; s = s->next) free_dungeon(s->d);
+    for (int i = 0; i < w->num_slabs; i++) free(w->slabs[i]);
+    free(w->slabs);
+    free(w->table);
+    free(w->queue);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+}
+
+// Queues a line of c at w; the caller has counted it in c->pending
+static bool worker_enqueue(Worker* w, Connection* c, const char* line, size_t len) {
+    size_t need = sizeof(c) + len + 1;
+    pthread_mutex_lock(&w->lock);
+    if (w->used + need > w->cap) {
+        size_t cap = w->cap ? w->cap : 65536;
+        while (cap < w->used + need) cap *= 2;
+        char* queue = realloc(w->queue, cap);
+        if (!queue) {
+            pthread_mutex_unlock(&w->lock);
+            return false;
+        }
+        w->queue = queue;
+        w->cap = cap;
+    }
+    memcpy(w->queue + w->used, &c, sizeof(c));
+    memcpy(w->queue + w->used + sizeof(c), line, len);
+    w->queue[w->used + need - 1] = '\0';
+    w->used += need;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    return true;
+}
+
+// Hands a complete line to the worker that owns its session
+static void server_dispatch(Server* srv, Connection* c, const char* line, size_t len) {
+    Worker* w = &srv->workers[strtoul(line, NULL, 10) % srv->num_workers];
+    pthread_mutex_lock(&c->lock);
+    c->pending++;
+    pthread_mutex_unlock(&c->lock);
+    if (!worker_enqueue(w, c, line, len)) {
+        // Dropped; the client sees no answer rather than the server stopping
+        pthread_mutex_lock(&c->lock);
+        c->pending--;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+static void conn_free(Connection* c) {
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c->out);
+    free(c->sessions);
+    free(c);
+}
+
+// Moves c from the open connections to the dead ones. A later event of the
+// same epoll batch can still point at c, so it is only freed after the batch.
+static void conn_retire(Server* srv, Connection* c) {
+    if (c->dead) return;
+    if (c->prev) c->prev->next = c->next;
+    else srv->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    c->dead = true;
+    c->prev = NULL;
+    c->next = srv->dead;
+    srv->dead = c;
+}
+
+// Stops all events for c and has every worker drop its games; the caller
+// holds c->lock
+static void conn_close(Server* srv, Connection* c) {
+    if (c->closed) return;
+    c->closed = true;
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    for (int i = 0; i < srv->num_workers; i++) 
+        c->pending += worker_enqueue(&srv->workers[i], c, "", 0);
+}
+
+// Writes what it can of c's output; true when c can be retired. Called by the
+// main thread only, with c->lock held.
+static bool conn_flush(Server* srv, Connection* c) {
+    size_t done = 0;
+    while (!c->closed && done < c->out_used) {
+        ssize_t n = write(c->fd, c->out + done, c->out_used - done);
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) conn_close(srv, c);
+            break;
+        }
+    }
+    if (c->closed) done = c->out_used;
+    memmove(c->out, c->out + done, c->out_used - done);
+    c->out_used -= done;
+    struct epoll_event ev = {EPOLLIN | (c->out_used ? EPOLLOUT : 0), {.ptr = c}};
+    if (!c->closed) epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    return c->closed && !c->pending && !c->flush_queued;
+}
+
+static void conn_read(Server* srv, Connection* c) {
+    for (;;) {
+        ssize_t n = read(c->fd, c->in + c->in_used, sizeof(c->in) - c->in_used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            pthread_mutex_lock(&c->lock);
+            conn_close(srv, c);
+            bool done = !c->pending && !c->flush_queued;
+            pthread_mutex_unlock(&c->lock);
+            if (done) conn_retire(srv, c);
+            return;
+        }
+        c->in_used += n;
+        char* start = c->in;
+        for (char* nl; (nl = memchr(start, '\n', c->in + c->in_used - start)); start = nl + 1) {
+            size_t len = nl - start;
+            if (len && start[len - 1] == '\r') len--;
+            if (len) server_dispatch(srv, c, start, len);
+        }
+        c->in_used -= start - c->in;
+        memmove(c->in, start, c->in_used);
+        if (c->in_used >= SERVER_LINE_MAX) c->in_used = 0; // Not a command; dropped
+    }
+}
+
+static void server_free_dead(Server* srv) {
+    while (srv->dead) {
+        Connection* c = srv->dead;
+        srv->dead = c->next;
+        conn_free(c);
+    }
+}
+
+// Stops and frees the started workers, then every connection, and closes
+// what run_server opened; path is NULL when the socket was not bound.
+// Returns the number of commands the workers ran.
+static long server_shutdown(Server* srv, const char* path) {
+    long commands = 0;
+    for (int i = 0; i < srv->num_workers; i++) {
+        Worker* w = &srv->workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stop = true;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->tid, NULL);
+        commands += w->commands;
+        worker_free(w);
+    }
+    free(srv->workers);
+    while (srv->conns) conn_retire(srv, srv->conns);
+    server_free_dead(srv);
+    pthread_mutex_destroy(&srv->flush_lock);
+    server_signal_fd = -1;
+    if (srv->listen_fd >= 0) close(srv->listen_fd);
+    if (srv->epoll_fd >= 0) close(srv->epoll_fd);
+    if (srv->wake_pipe[0] >= 0) close(srv->wake_pipe[0]);
+    if (srv->wake_pipe[1] >= 0) close(srv->wake_pipe[1]);
+    if (path) unlink(path);
+    return commands;
+}
+
+// Serves games on a Unix socket until SIGINT or SIGTERM
+int run_server(const char* path, int threads, OutMode mode) {
+    if (mode == OUT_BINARY) {
+        printf("De server kent alleen text en csv\n");
+        return 1;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socketpad te lang: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); // Left by an earlier server
+
+    Server srv = {.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0), .epoll_fd = epoll_create1(0), 
+                  .wake_pipe = {-1, -1}};
+    pthread_mutex_init(&srv.flush_lock, NULL);
+    bool bound = srv.listen_fd >= 0 && bind(srv.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if (!bound || srv.epoll_fd < 0 || pipe(srv.wake_pipe) != 0 || listen(srv.listen_fd, 128) != 0 ||
+        !set_nonblocking(srv.listen_fd) || !set_nonblocking(srv.wake_pipe[0]) || !set_nonblocking(srv.wake_pipe[1])) {
+        printf("Kon niet luisteren op %s\n", path);
+        server_shutdown(&srv, bound ? path : NULL);
+        return 1;
+    }
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+    }
+    srv.workers = calloc(threads, sizeof(Worker));
+    for (int i = 0; i < threads; i++) {
+        Worker* w = srv.workers ? &srv.workers[i] : NULL;
+        if (w) {
+            w->server = &srv;
+            w->mask = 1023;
+            w->table = calloc(w->mask + 1, sizeof(Session*));
+            w->sink = (Sink){.mode = mode, .drain = worker_drain, .ctx = w};
+            pthread_mutex_init(&w->lock, NULL);
+            pthread_cond_init(&w->wake, NULL);
+        }
+        if (!w || !w->table || pthread_create(&w->tid, NULL, worker_main, w) != 0) {
+            printf("Kon worker %d niet starten\n", i);
+            if (w) worker_free(w);
+            server_shutdown(&srv, path);
+            return 1;
+        }
+        srv.num_workers++;
+    }
+
+    server_signal_fd = srv.wake_pipe[1];
+    signal(SIGINT, server_signal);
+    signal(SIGTERM, server_signal);
+    signal(SIGPIPE, SIG_IGN);
+    struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+    epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.listen_fd, &ev);
+    ev.data.ptr = &srv;
+    epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.wake_pipe[0], &ev);
+    printf("Server op %s met %d workers\n", path, threads);
+    fflush(stdout);
+
+    struct epoll_event events[64];
+    while (!server_stopping) {
+        int n = epoll_wait(srv.epoll_fd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            void* tag = events[i].data.ptr;
+            if (!tag) {
+                // New clients
+                for (int fd; (fd = accept(srv.listen_fd, NULL, NULL)) >= 0; ) {
+                    Connection* c = calloc(1, sizeof(Connection));
+                    Session** sessions = calloc(srv.num_workers, sizeof(Session*));
+                    if (!c || !sessions || !set_nonblocking(fd)) {
+                        free(c);
+                        free(sessions);
+                        close(fd);
+                        continue;
+                    }
+                    c->fd = fd;
+                    c->sessions = sessions;
+                    pthread_mutex_init(&c->lock, NULL);
+                    c->next = srv.conns;
+                    if (srv.conns) srv.conns->prev = c;
+                    srv.conns = c;
+                    struct epoll_event cev = {EPOLLIN, {.ptr = c}};
+                    epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+                }
+            } else if (tag == &srv) {
+                // Workers have output ready
+                char drain[256];
+                while (read(srv.wake_pipe[0], drain, sizeof(drain)) > 0);
+                pthread_mutex_lock(&srv.flush_lock);
+                Connection* list = srv.flush_list;
+                srv.flush_list = NULL;
+                pthread_mutex_unlock(&srv.flush_lock);
+                while (list) {
+                    Connection* c = list;
+                    list = c->next_flush;
+                    pthread_mutex_lock(&c->lock);
+                    c->flush_queued = false;
+                    bool done = conn_flush(&srv, c);
+                    pthread_mutex_unlock(&c->lock);
+                    if (done) conn_retire(&srv, c);
+                }
+            } else {
+                Connection* c = tag;
+                if (c->closed) continue; // Closed earlier in this batch
+                if (events[i].events & EPOLLOUT) {
+                    pthread_mutex_lock(&c->lock);
+                    bool done = conn_flush(&srv, c);
+                    pthread_mutex_unlock(&c->lock);
+                    if (done) conn_retire(&srv, c);
+                    if (c->closed) continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) conn_read(&srv, c);
+            }
+        }
+        server_free_dead(&srv);
+    }
+
+    printf("Server gestopt na %ld commando's\n", server_shutdown(&srv, path));
+    return 0;
+}
+
+// Scripted client for -C: plays sessions games over one connection, all
+// sessions one turn per round, and plays each game along on its own copy of
+// the dungeon to check the server's answers. Returns the mismatches.
+static long client_play(FILE* in, FILE* out, Dungeon** games, const char** expected, 
+                        int sessions, int rooms, int turns, uint64_t seed) {
+    Rng rng;
+    rng_seed(&rng, seed);
+    long commands = 0, mismatches = 0, won = 0, died = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Turn 0 starts the games and the last one ends those still running
+    char line[512];
+    for (int turn = 0; turn <= turns; turn++) {
+        int waiting = 0;
+        for (int i = 0; i < sessions; i++) {
+            Dungeon* d = games[i];
+            if (!d) continue;
+            if (turn == 0) {
+                fprintf(out, "%d new %d %llu\n", i, rooms, (unsigned long long)(seed + i));
+                expected[i] = "ok";
+            } else if (turn == turns) {
+                fprintf(out, "%d end\n", i);
+                expected[i] = "quit";
+            } else {
+                const int choices[] = {1, 1, 2, 3, 4};
+                Room* current = find_room_by_id(d, d->player.current_room_id);
+                int action = choices[rng_below(&rng, 5)], target = -1;
+                if (action == 1 && !current->num_doors) action = 2;
+                if (action == 1) target = current->doors[rng_below(&rng, current->num_doors)];
+                current->visited = true;
+                d->turns++;
+                StepResult result = game_step(d, current, action, target);
+                expected[i] = result == STEP_DIED ? "died" : result == STEP_QUIT ? "quit" 
+                            : d->player.has_treasure ? "won" : "ok";
+                if (action == 1) fprintf(out, "%d 1 %d\n", i, target);
+                else fprintf(out, "%d %d\n", i, action);
+            }
+            waiting++;
+            commands++;
+        }
+        if (!waiting) break;
+        fflush(out);
+
+        // Only the last line of an answer has a single word after the session
+        while (waiting && fgets(line, sizeof(line), in)) {
+            char word[16];
+            int id, used = 0;
+            if (sscanf(line, "%d %15s%n", &id, word, &used) != 2 || line[used] != '\n' || 
+                id < 0 || id >= sessions || !expected[id]) continue;
+            if (strcmp(word, "ok") && strcmp(word, "won") && strcmp(word, "died") && 
+                strcmp(word, "quit") && strcmp(word, "error")) continue;
+            mismatches += strcmp(word, expected[id]) != 0;
+            won += strcmp(word, "won") == 0;
+            died += strcmp(word, "died") == 0;
+            if (strcmp(expected[id], "ok") != 0) {
+                free_dungeon(games[id]);
+                games[id] = NULL;
+            }
+            expected[id] = NULL;
+            waiting--;
+        }
+        if (waiting) {
+            printf("Verbinding verbroken, %d antwoorden ontbreken\n", waiting);
+            mismatches += waiting;
+            break;
+        }
+    }
+
+    double seconds = elapsed_seconds(&start);
+    printf("%d sessies, %ld commando's in %.2f s (%.0f/s)\n", sessions, commands, seconds, 
+           seconds > 0 ? commands / seconds : 0.0);
+    printf("Gewonnen: %ld, dood: %ld, afwijkingen: %ld\n", won, died, mismatches);
+    return mismatches;
+}
+
+// One connection of -C; returns the mismatches, 1 when it could not play
+static long client_connection(const char* path, int sessions, int rooms, int turns, uint64_t seed) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) return 1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        printf("Kon niet verbinden met %s\n", path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    FILE* in = fdopen(fd, "r");
+    int out_fd = in ? dup(fd) : -1;
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    Dungeon** games = calloc(sessions, sizeof(Dungeon*));
+    const char** expected = calloc(sessions, sizeof(char*));
+    bool ready = in && out && games && expected;
+    for (int i = 0; ready && i < sessions; i++) {
+        games[i] = generate_dungeon(rooms, seed + i);
+        ready = games[i] != NULL;
+        if (!ready) break;
+        populate_rooms(games[i]);
+        games[i]->headless = true;
+    }
+
+    long mismatches = 1;
+    if (ready) {
+        setvbuf(out, NULL, _IOFBF, 1 << 16);
+        mismatches = client_play(in, out, games, expected, sessions, rooms, turns, seed);
+    } else {
+        printf("Niet genoeg geheugen voor %d sessies\n", sessions);
+    }
+    for (int i = 0; games && i < sessions; i++) if (games[i]) free_dungeon(games[i]);
+    free(games);
+    free(expected);
+    if (in) fclose(in);
+    else close(fd);
+    if (out) fclose(out);
+    else if (out_fd >= 0) close(out_fd);
+    return mismatches;
+}
+
+typedef struct {
+    const char* path;
+    int sessions, rooms, turns;
+    uint64_t seed;
+    pthread_t tid;
+    long mismatches;
+} ClientJob;
+
+static void* client_thread(void* arg) {
+    ClientJob* job = arg;
+    job->mismatches = client_connection(job->path, job->sessions, job->rooms, job->turns, job->seed);
+    return NULL;
+}
+
+// Plays over connections connections at once, all with session ids 0 to
+// sessions - 1 but games of their own: connection k starts from seed + k * sessions
+int run_client(const char* path, int sessions, int rooms, int turns, uint64_t seed, int connections) {
+    ClientJob* jobs = calloc(connections, sizeof(ClientJob));
+    if (!jobs) return 1;
+    int started = 1;
+    for (int k = 0; k < connections; k++) 
+        jobs[k] = (ClientJob){path, sessions, rooms, turns, seed + (uint64_t)k * sessions, 0, 0};
+    // Connection 0 runs on the calling thread
+    while (started < connections && pthread_create(&jobs[started].tid, NULL, client_thread, &jobs[started]) == 0) 
+        started++;
+    client_thread(&jobs[0]);
+    long mismatches = 0;
+    for (int k = 1; k < started; k++) pthread_join(jobs[k].tid, NULL);
+    for (int k = 0; k < started; k++) mismatches += jobs[k].mismatches;
+    if (connections > 1) printf("%d verbindingen, afwijkingen: %ld\n", started, mismatches);
+    free(jobs);
+    return mismatches || started < connections ? 1 : 0;
+}
+#endif
+
+void free_dungeon(Dungeon* d) {
+#if !DUNGEON_ARENA
+    if (d->map) {
+        // Only rooms copied out of the mapping own memory; doors stay in the file
+        for (uint32_t i = 0; i < d->map->overlay_cap; i++) 
+            free(d->map->overlay[i]);
+    } else {
+        free(d->doors);
+        free(d->rooms);
+    }
+#endif
+#ifdef HAVE_MMAP
+    if (d->map) {
+        munmap(d->map->base, d->map->size);
+        free(d->map->overlay);
+        free(d->map);
+    }
+#endif
+    if (d->graph) free_graph(d->graph);
+    if (d->lazy) {
+        free(d->lazy->slots); free(d->lazy->index); free(d->lazy->saved); free(d->lazy);
+    }
+    journal_close(d);
+    arena_release(&d->arena);
+    free(d);
+}